@@ -0,0 +1,74 @@
+#include "stdlib.h"
+#include "arena.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+Arena::Arena(size_t chunk_size) : cursor(NULL), limit(NULL), chunk_size(chunk_size), allocated(0) {}
+
+Arena::~Arena() {
+    release();
+}
+
+void* Arena::allocate(size_t bytes, size_t align) {
+    size_t padding = (align - ((size_t) cursor % align)) % align;
+    if (cursor == NULL || cursor + padding + bytes > limit) {
+        // start a new chunk, oversized requests get a chunk of their own
+        size_t size = bytes + align > chunk_size ? bytes + align : chunk_size;
+        char* chunk = static_cast<char*>(malloc(size));
+        if (chunk == NULL) {
+            throw std::bad_alloc();
+        }
+        chunks.push_back(chunk);
+        cursor = chunk;
+        limit = chunk + size;
+        padding = (align - ((size_t) cursor % align)) % align;
+    }
+    void* result = cursor + padding;
+    cursor += padding + bytes;
+    allocated += bytes;
+    return result;
+}
+
+void Arena::release() {
+    for (char* chunk : chunks) {
+        free(chunk);
+    }
+    chunks.clear();
+    cursor = NULL;
+    limit = NULL;
+    allocated = 0;
+}
+
+ArenaPool::ArenaPool() {
+    int num_arenas = 1;
+#ifdef _OPENMP
+    num_arenas = omp_get_max_threads();
+#endif
+    for (int i = 0; i < num_arenas; i++) {
+        arenas.push_back(std::unique_ptr<Arena>(new Arena()));
+    }
+}
+
+Arena& ArenaPool::local() {
+#ifdef _OPENMP
+    return *arenas[omp_get_thread_num()];
+#else
+    return *arenas[0];
+#endif
+}
+
+void ArenaPool::release() {
+    for (auto& arena : arenas) {
+        arena->release();
+    }
+}
+
+size_t ArenaPool::bytesAllocated() const {
+    size_t total = 0;
+    for (auto& arena : arenas) {
+        total += arena->bytesAllocated();
+    }
+    return total;
+}
@@ -0,0 +1,86 @@
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include <new>
+#include <utility>
+
+#ifndef ARENA_H
+#define ARENA_H
+
+// Size of each chunk an arena grabs from the heap
+#define ARENA_CHUNK_SIZE (1 << 20)
+
+// Bump allocator for the many small objects built while encoding an image.
+// Allocation is a pointer increment; individual frees are no-ops and all
+// memory is returned at once by release() or when the arena is destroyed.
+// Destructors of objects created in the arena are never run, so they must
+// only own memory that also comes from the arena.
+class Arena {
+public:
+    explicit Arena(size_t chunk_size = ARENA_CHUNK_SIZE);
+    ~Arena();
+
+    void* allocate(size_t bytes, size_t align = alignof(std::max_align_t));
+
+    template <typename T, typename... Args>
+    T* create(Args&&... args) {
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // Free every chunk at once
+    void release();
+
+    // Bytes handed out since the last release
+    size_t bytesAllocated() const { return allocated; }
+
+private:
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+
+    std::vector<char*> chunks;
+    char* cursor;
+    char* limit;
+    size_t chunk_size;
+    size_t allocated;
+};
+
+// STL allocator that places container storage in an arena
+template <typename T>
+struct ArenaAllocator {
+    typedef T value_type;
+
+    Arena* arena;
+
+    ArenaAllocator(Arena* arena) : arena(arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t) {}
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.arena == b.arena; }
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.arena != b.arena; }
+
+// One arena per OpenMP thread, so threads in a parallel loop allocate
+// from their own sub-arena without locking. Without OpenMP there is a
+// single arena.
+class ArenaPool {
+public:
+    ArenaPool();
+
+    // Arena of the calling thread
+    Arena& local();
+
+    // Free every sub-arena at once
+    void release();
+
+    size_t bytesAllocated() const;
+
+private:
+    std::vector<std::unique_ptr<Arena>> arenas;
+};
+
+#endif
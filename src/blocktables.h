@@ -0,0 +1,149 @@
+#ifndef _USE_MATH_DEFINES
+#define _USE_MATH_DEFINES // Pi
+#endif
+
+#include <array>
+#include "math.h"
+
+#ifndef BLOCKTABLES_H
+#define BLOCKTABLES_H
+
+// Per block size tables of the transform pipeline, built by the compiler.
+// C++11 constexpr functions are a single return statement, so the
+// generators below recurse instead of loop, and each table is expanded
+// from a compile-time list of its indices.
+
+// Block sizes the transform and quantizer are instantiated for
+#define FOR_EACH_BLOCK_SIZE(X, T) X(T, 4) X(T, 8) X(T, 16)
+
+template <int... I>
+struct IndexList {};
+
+// IndexList<0, 1, ..., N - 1>
+template <int N, int... I>
+struct MakeIndexList : MakeIndexList<N - 1, N - 1, I...> {};
+template <int... I>
+struct MakeIndexList<0, I...> {
+    typedef IndexList<I...> type;
+};
+
+// Sum of the Taylor series of cos from <term>, the term in x^(2k), on:
+// accurate to double precision for |x| <= pi/2 by k = 12
+constexpr double cosSeries(double x2, double term, int k) {
+    return k > 12 ? 0 : term + cosSeries(x2, -term * x2 / ((2*k + 1) * (2*k + 2)), k + 1);
+}
+
+// cos(m pi / 2n) for 0 <= m <= n
+constexpr double cosQuarter(int m, int n) {
+    return cosSeries((m * M_PI / (2.0 * n)) * (m * M_PI / (2.0 * n)), 1.0, 0);
+}
+
+// cos(m pi / 2n) for 0 <= m <= 2n
+constexpr double cosHalf(int m, int n) {
+    return m > n ? -cosQuarter(2*n - m, n) : cosQuarter(m, n);
+}
+
+// cos(m pi / 2n) for m >= 0, reduced to the first half period exactly,
+// in integers
+constexpr double cosMultiple(int m, int n) {
+    return cosHalf(m % (4*n) > 2*n ? 4*n - m % (4*n) : m % (4*n), n);
+}
+
+constexpr double sqrtNewton(double x, double guess, int iterations) {
+    return iterations == 0 ? guess : sqrtNewton(x, 0.5 * (guess + x / guess), iterations - 1);
+}
+
+constexpr double constSqrt(double x) {
+    return sqrtNewton(x, x > 1 ? x : 1.0, 40);
+}
+
+// Orthonormal DCT-II basis entry <idx> = k * N + n of NxN blocks:
+// a(k) * cos((2n + 1) k pi / 2N), with a(0) = sqrt(1/N) and
+// a(k) = sqrt(2/N) otherwise
+template <int N>
+constexpr double dctBasis(int idx) {
+    return constSqrt((idx / N > 0 ? 2.0 : 1.0) / N) * cosMultiple((2 * (idx % N) + 1) * (idx / N), N);
+}
+
+// Position in zigzag order of the coefficient at (row, col) of an NxN
+// block: the anti-diagonals row + col = s are taken in turn, running up
+// the even ones and down the odd ones, as in JPEG
+template <int N>
+constexpr int zigzagPosition(int row, int col) {
+    return ((row + col < N) ? (row + col) * (row + col + 1) / 2
+                            : N * N - (2*N - 1 - row - col) * (2*N - row - col) / 2)
+        + (((row + col) % 2 == 1) ? row - ((row + col < N) ? 0 : row + col - N + 1)
+                                  : ((row + col < N) ? row + col : N - 1) - row);
+}
+
+// Row-major index of the coefficient at zigzag position <pos>, searching
+// from row-major index <idx>
+template <int N>
+constexpr int zigzagIndex(int pos, int idx) {
+    return zigzagPosition<N>(idx / N, idx % N) == pos ? idx : zigzagIndex<N>(pos, idx + 1);
+}
+
+// Quantization tables: as in JPEG, luma has one and the two chroma
+// components share the other
+enum QuantTableId {
+    QUANT_LUMA,
+    QUANT_CHROMA,
+    NUM_QUANT_TABLES
+};
+
+// Steps of an 8x8 quantization table, each 1 to 255, row-major; other
+// block sizes resample it
+typedef std::array<unsigned char, 64> QuantMatrix;
+
+// Tables of Annex K of the JPEG standard, the steps at quality 50
+// https://en.wikipedia.org/wiki/Quantization_(image_processing)#Frequency_quantization_for_image_compression
+constexpr int quant_matrices[NUM_QUANT_TABLES][64] = {
+    {
+        16, 11, 10, 16, 24,  40,  51,  61,
+        12, 12, 14, 19, 26,  58,  60,  55,
+        14, 13, 16, 24, 40,  57,  69,  56,
+        14, 17, 22, 29, 51,  87,  80,  62,
+        18, 22, 37, 56, 68,  109, 103, 77,
+        24, 35, 55, 64, 81,  104, 113, 92,
+        49, 64, 78, 87, 103, 121, 120, 101,
+        72, 92, 95, 98, 112, 100, 103, 99
+    },
+    {
+        17, 18, 24, 47, 99, 99, 99, 99,
+        18, 21, 26, 66, 99, 99, 99, 99,
+        24, 26, 56, 99, 99, 99, 99, 99,
+        47, 66, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99
+    }
+};
+
+template <int N, int... I>
+constexpr std::array<double, N * N> makeDctBasis(IndexList<I...>) {
+    return {{ dctBasis<N>(I)... }};
+}
+
+template <int N, int... I>
+constexpr std::array<int, N * N> makeZigzag(IndexList<I...>) {
+    return {{ zigzagIndex<N>(I, 0)... }};
+}
+
+// Tables of NxN blocks, all row-major:
+//   basis[k * N + n]  DCT basis function k at sample n
+//   zigzag[pos]       index of the coefficient at zigzag position <pos>
+template <int N>
+struct BlockTables {
+    static constexpr int size = N;
+    static constexpr int pixels = N * N;
+    static constexpr std::array<double, N * N> basis = makeDctBasis<N>(typename MakeIndexList<N * N>::type());
+    static constexpr std::array<int, N * N> zigzag = makeZigzag<N>(typename MakeIndexList<N * N>::type());
+};
+
+template <int N>
+constexpr std::array<double, N * N> BlockTables<N>::basis;
+template <int N>
+constexpr std::array<int, N * N> BlockTables<N>::zigzag;
+
+#endif
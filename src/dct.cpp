@@ -1,104 +1,1094 @@
+#include <algorithm>
+#include <immintrin.h>
+#include "stdio.h"
+#include "stdlib.h"
 #include "dct.h"
+#include "blocktables.h"
 
-// Forward DCT operation for NxN block
-// If <all> set, then YCbCr each have DCT performed on them.
-// Else, only Y has DCT performed on it.
-std::vector<std::shared_ptr<PixelYcbcr>> DCT(std::vector<std::shared_ptr<PixelYcbcr>> pixels, int block_size, bool all) {
-    return pixels;
+static const char* dct_kernel_names[NUM_DCT_KERNELS] = {"matrix", "aan", "llm"};
+static const char* simd_level_names[NUM_SIMD_LEVELS] = {"none", "sse2", "avx2", "avx512"};
+// what DCT_AAN runs as on each SIMD level
+static const char* aan_implementation_names[NUM_SIMD_LEVELS] = {"aan", "aan/sse2", "aan/avx2", "aan/avx512"};
 
-    std::vector<std::shared_ptr<PixelYcbcr>> F(block_size * block_size);
+SimdLevel detectSimdLevel() {
+    // may run before static constructors, where the CPU model isn't set up yet
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return SIMD_AVX512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        return SIMD_AVX2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        return SIMD_SSE2;
+    }
+    return SIMD_NONE;
+}
 
-    // Output: F(p, q)
-    for (int p = 0; p < block_size; p++) {
-        for (int q = 0; q < block_size; q++) {
-            int vectorized_idx_pq = sub2ind(block_size, q, p);
-            double ap = (p > 0) ? (sqrt(2/block_size)): (1/sqrt(block_size));
-            double aq = (q > 0) ? (sqrt(2/block_size)) : (1/sqrt(block_size));
-
-            double tmp_y, tmp_cb, tmp_cr;
-            tmp_y = 0;
-            tmp_cb = 0;
-            tmp_cr = 0;
-
-            // Input: f(m, n)
-            for (int m = 0; m < block_size; m++) { // row
-                for (int n = 0; n < block_size; n++) { // cow
-                    int vectorized_idx_mn = sub2ind(block_size, n, m);
-                    std::shared_ptr<PixelYcbcr> f_mn = pixels[vectorized_idx_mn];
-
-                    double xprod = cos((2*m + 1)*p*M_PI/(2*block_size));
-                    double yprod = cos((2*n + 1)*q*M_PI/(2*block_size));
-
-                    tmp_y += ((f_mn->y) * xprod * yprod);
-                    if (all) {
-                        tmp_cr += ((f_mn->cr) * xprod * yprod);
-                        tmp_cb += ((f_mn->cb) * xprod * yprod);
-                    }
-                }
+static SimdLevel simd_level = detectSimdLevel();
+
+SimdLevel dctSimdLevel() {
+    return simd_level;
+}
+
+bool setDctSimdLevel(SimdLevel level) {
+    if (level > detectSimdLevel()) {
+        return false;
+    }
+    simd_level = level;
+    return true;
+}
+
+const char* simdLevelName(SimdLevel level) {
+    return simd_level_names[level];
+}
+
+bool parseSimdLevel(const std::string& name, SimdLevel& level) {
+    for (int l = 0; l < NUM_SIMD_LEVELS; l++) {
+        if (name == simd_level_names[l]) {
+            level = (SimdLevel) l;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* dctImplementationName(DctKernel kernel) {
+    return kernel == DCT_AAN ? aan_implementation_names[simd_level] : dct_kernel_names[kernel];
+}
+
+const char* dctKernelName(DctKernel kernel) {
+    return dct_kernel_names[kernel];
+}
+
+bool parseDctKernel(const std::string& name, DctKernel& kernel) {
+    for (int k = 0; k < NUM_DCT_KERNELS; k++) {
+        if (name == dct_kernel_names[k]) {
+            kernel = (DctKernel) k;
+            return true;
+        }
+    }
+    return false;
+}
+
+// AAN leaves coefficient (u, v) scaled by aan(u) aan(v), with
+// aan(0) = 1 and aan(k) = sqrt(2) cos(k pi / 16)
+static double aanScale(int k) {
+    return k == 0 ? 1.0 : sqrt(2.0) * cos(k * M_PI / 16);
+}
+
+double dctForwardScale(DctKernel kernel, int idx) {
+    switch (kernel) {
+        case DCT_AAN:
+            return 8 * aanScale(idx / FAST_DCT_SIZE) * aanScale(idx % FAST_DCT_SIZE);
+        case DCT_LLM:
+            return 8;
+        default:
+            return 1;
+    }
+}
+
+double dctInverseScale(DctKernel kernel, int idx) {
+    switch (kernel) {
+        case DCT_AAN:
+            return aanScale(idx / FAST_DCT_SIZE) * aanScale(idx % FAST_DCT_SIZE);
+        default:
+            return 1;
+    }
+}
+
+// Round to the nearest integer, ties to even like rint(), but inline:
+// the conversion rounds in the default MXCSR mode
+static inline double roundToInteger(double x) {
+    return (double) _mm_cvtsd_si64(_mm_set_sd(x));
+}
+
+// Write the P forward coefficients in <values> to <out>: as they are, or,
+// given <reciprocals>, quantized by multiplying each with its reciprocal
+// and rounding to the nearest integer
+template <int P, typename T, typename V>
+static inline void storeCoefficients(Span<T> out, const V* values, const double* reciprocals) {
+    if (reciprocals) {
+        for (int i = 0; i < P; i++) {
+            out[i] = fromDouble<T>(roundToInteger(values[i] * reciprocals[i]));
+        }
+    } else {
+        for (int i = 0; i < P; i++) {
+            out[i] = fromDouble<T>(values[i]);
+        }
+    }
+}
+
+// Forward transform of one NxN channel as two 1-D passes: every row,
+// then every column of the row results
+template <typename T, int N>
+static void matrixDctChannel(Span<const T> in, Span<T> out, const double* reciprocals) {
+    const std::array<double, N * N>& basis = BlockTables<N>::basis;
+    double rows[N * N];
+
+    for (int m = 0; m < N; m++) {
+        const T* row = in.data() + m * N;
+        for (int q = 0; q < N; q++) {
+            double sum = 0;
+            for (int n = 0; n < N; n++) {
+                sum += basis[q * N + n] * row[n];
             }
+            rows[m * N + q] = sum;
+        }
+    }
 
-            F[vectorized_idx_pq] = std::make_shared<PixelYcbcr>();
-            F[vectorized_idx_pq]->y = ap * aq * tmp_y;
-            if (all) {
-                F[vectorized_idx_pq]->cr = ap * aq * tmp_cr;
-                F[vectorized_idx_pq]->cb = ap * aq * tmp_cb;
-            } else {
-                F[vectorized_idx_pq]->cr = 0;
-                F[vectorized_idx_pq]->cb = 0;
+    double coeffs[N * N];
+    for (int q = 0; q < N; q++) {
+        for (int p = 0; p < N; p++) {
+            double sum = 0;
+            for (int m = 0; m < N; m++) {
+                sum += basis[p * N + m] * rows[m * N + q];
+            }
+            coeffs[p * N + q] = sum;
+        }
+    }
+    // only write <out> once <in> is fully read, so in place works
+    storeCoefficients<N * N>(out, coeffs, reciprocals);
+}
+
+// Inverse transform of one NxN channel, columns then rows, with the
+// transposed basis
+template <typename T, int N>
+static void matrixIdctChannel(Span<const T> in, Span<T> out) {
+    const std::array<double, N * N>& basis = BlockTables<N>::basis;
+    double cols[N * N];
+
+    for (int q = 0; q < N; q++) {
+        for (int m = 0; m < N; m++) {
+            double sum = 0;
+            for (int p = 0; p < N; p++) {
+                sum += basis[p * N + m] * in[p * N + q];
+            }
+            cols[m * N + q] = sum;
+        }
+    }
+
+    for (int m = 0; m < N; m++) {
+        const double* col = cols + m * N;
+        for (int n = 0; n < N; n++) {
+            double sum = 0;
+            for (int q = 0; q < N; q++) {
+                sum += basis[q * N + n] * col[q];
+            }
+            out[m * N + n] = fromDouble<T>(sum);
+        }
+    }
+}
+
+// Inverse transform of the KxK lowest frequencies of an NxN channel,
+// columns then rows like matrixIdctChannel(). The orthonormal KxK
+// coefficients of the block decimated by N / K are its NxN ones times
+// K / N.
+template <typename T, int N, int K>
+static void scaledIdctChannel(Span<const T> in, Span<T> out) {
+    const std::array<double, K * K>& basis = BlockTables<K>::basis;
+    double cols[K * K];
+
+    for (int q = 0; q < K; q++) {
+        for (int m = 0; m < K; m++) {
+            double sum = 0;
+            for (int p = 0; p < K; p++) {
+                sum += basis[p * K + m] * in[p * N + q];
             }
+            cols[m * K + q] = sum * K / N;
         }
     }
 
-    return F;
+    for (int m = 0; m < K; m++) {
+        const double* col = cols + m * K;
+        for (int n = 0; n < K; n++) {
+            double sum = 0;
+            for (int q = 0; q < K; q++) {
+                sum += basis[q * K + n] * col[q];
+            }
+            out[m * K + n] = fromDouble<T>(sum);
+        }
+    }
 }
 
-// Inverse DCT operation for NxN block
-// If <all> set, then YCbCr each have IDCT performed on them.
-// Else, only Y has IDCT performed on it.
-std::vector<std::shared_ptr<PixelYcbcr>> IDCT(std::vector<std::shared_ptr<PixelYcbcr>> pixels, int block_size, bool all) {
-    return pixels;
+// AAN 8-point forward DCT of the 8 values d[0], d[stride], ..., d[7 * stride]
+// in place: 5 multiplies, outputs scaled as dctForwardScale(DCT_AAN).
+// V is a scalar of type S, or a SIMD vector of S holding the same element
+// of several rows, which runs the transform down every column at once.
+template <typename S, typename V>
+static inline __attribute__((always_inline)) void aanForward(V* d, int stride) {
+    V tmp0 = d[0] + d[7 * stride];
+    V tmp7 = d[0] - d[7 * stride];
+    V tmp1 = d[stride] + d[6 * stride];
+    V tmp6 = d[stride] - d[6 * stride];
+    V tmp2 = d[2 * stride] + d[5 * stride];
+    V tmp5 = d[2 * stride] - d[5 * stride];
+    V tmp3 = d[3 * stride] + d[4 * stride];
+    V tmp4 = d[3 * stride] - d[4 * stride];
 
-    std::vector<std::shared_ptr<PixelYcbcr>> f(block_size * block_size);
+    // even part
+    V tmp10 = tmp0 + tmp3;
+    V tmp13 = tmp0 - tmp3;
+    V tmp11 = tmp1 + tmp2;
+    V tmp12 = tmp1 - tmp2;
 
-    // Output: f(m, n)
-    for (int m = 0; m < block_size; m++) {
-        for (int n = 0; n < block_size; n++) {
-            int vectorized_idx_mn = sub2ind(block_size, n, m);
+    d[0] = tmp10 + tmp11;
+    d[4 * stride] = tmp10 - tmp11;
+
+    V z1 = (tmp12 + tmp13) * S(0.707106781);   // c4
+    d[2 * stride] = tmp13 + z1;
+    d[6 * stride] = tmp13 - z1;
+
+    // odd part
+    tmp10 = tmp4 + tmp5;
+    tmp11 = tmp5 + tmp6;
+    tmp12 = tmp6 + tmp7;
+
+    V z5 = (tmp10 - tmp12) * S(0.382683433);   // c6
+    V z2 = S(0.541196100) * tmp10 + z5;        // c2 - c6
+    V z4 = S(1.306562965) * tmp12 + z5;        // c2 + c6
+    V z3 = tmp11 * S(0.707106781);             // c4
+
+    V z11 = tmp7 + z3;
+    V z13 = tmp7 - z3;
+
+    d[5 * stride] = z13 + z2;
+    d[3 * stride] = z13 - z2;
+    d[stride] = z11 + z4;
+    d[7 * stride] = z11 - z4;
+}
+
+// AAN 8-point inverse DCT in place, of inputs scaled as
+// dctInverseScale(DCT_AAN)
+template <typename S, typename V>
+static inline __attribute__((always_inline)) void aanInverse(V* d, int stride) {
+    // even part
+    V tmp0 = d[0];
+    V tmp1 = d[2 * stride];
+    V tmp2 = d[4 * stride];
+    V tmp3 = d[6 * stride];
+
+    V tmp10 = tmp0 + tmp2;
+    V tmp11 = tmp0 - tmp2;
+    V tmp13 = tmp1 + tmp3;
+    V tmp12 = (tmp1 - tmp3) * S(1.414213562) - tmp13;  // 2 c4
+
+    tmp0 = tmp10 + tmp13;
+    tmp3 = tmp10 - tmp13;
+    tmp1 = tmp11 + tmp12;
+    tmp2 = tmp11 - tmp12;
+
+    // odd part
+    V tmp4 = d[stride];
+    V tmp5 = d[3 * stride];
+    V tmp6 = d[5 * stride];
+    V tmp7 = d[7 * stride];
+
+    V z13 = tmp6 + tmp5;
+    V z10 = tmp6 - tmp5;
+    V z11 = tmp4 + tmp7;
+    V z12 = tmp4 - tmp7;
+
+    tmp7 = z11 + z13;
+    tmp11 = (z11 - z13) * S(1.414213562);  // 2 c4
+
+    V z5 = (z10 + z12) * S(1.847759065);   // 2 c2
+    tmp10 = S(1.082392200) * z12 - z5;     // 2 (c2 - c6)
+    tmp12 = S(-2.613125930) * z10 + z5;    // -2 (c2 + c6)
+
+    tmp6 = tmp12 - tmp7;
+    tmp5 = tmp11 - tmp6;
+    tmp4 = tmp10 + tmp5;
+
+    d[0] = tmp0 + tmp7;
+    d[7 * stride] = tmp0 - tmp7;
+    d[stride] = tmp1 + tmp6;
+    d[6 * stride] = tmp1 - tmp6;
+    d[2 * stride] = tmp2 + tmp5;
+    d[5 * stride] = tmp2 - tmp5;
+    d[4 * stride] = tmp3 + tmp4;
+    d[3 * stride] = tmp3 - tmp4;
+}
+
+template <typename T>
+static void aanDctChannel(Span<const T> in, Span<T> out, const double* reciprocals) {
+    double d[FAST_DCT_PIXELS];
+    std::copy(in.begin(), in.end(), d);
+    for (int i = 0; i < FAST_DCT_SIZE; i++) {
+        aanForward<double>(d + i * FAST_DCT_SIZE, 1);
+    }
+    for (int i = 0; i < FAST_DCT_SIZE; i++) {
+        aanForward<double>(d + i, FAST_DCT_SIZE);
+    }
+    storeCoefficients<FAST_DCT_PIXELS>(out, d, reciprocals);
+}
+
+template <typename T>
+static void aanIdctChannel(Span<const T> in, Span<T> out) {
+    double d[FAST_DCT_PIXELS];
+    std::copy(in.begin(), in.end(), d);
+    for (int i = 0; i < FAST_DCT_SIZE; i++) {
+        aanInverse<double>(d + i, FAST_DCT_SIZE);
+    }
+    for (int i = 0; i < FAST_DCT_SIZE; i++) {
+        aanInverse<double>(d + i * FAST_DCT_SIZE, 1);
+    }
+    // the two passes leave the factor 8 of the 2-D inverse in
+    for (int i = 0; i < FAST_DCT_PIXELS; i++) {
+        out[i] = fromDouble<T>(d[i] / 8);
+    }
+}
+
+// SIMD versions of the AAN kernels, in single precision. Each keeps the
+// rows of a block in vector registers, runs the 1-D transform down the
+// columns, transposes in registers, runs it again for the rows and
+// transposes back. Given <reciprocals>, the forward kernels quantize each
+// row on its way out, as storeCoefficients() does.
+
+// SSE2 holds each row as two halves: <lo> is columns 0-3, <hi> columns 4-7
+
+static inline void loadRowSse2(const float* p, __m128& lo, __m128& hi) {
+    lo = _mm_loadu_ps(p);
+    hi = _mm_loadu_ps(p + 4);
+}
+
+static inline void loadRowSse2(const double* p, __m128& lo, __m128& hi) {
+    lo = _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(p)), _mm_cvtpd_ps(_mm_loadu_pd(p + 2)));
+    hi = _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(p + 4)), _mm_cvtpd_ps(_mm_loadu_pd(p + 6)));
+}
+
+static inline void loadRowSse2(const int16_t* p, __m128& lo, __m128& hi) {
+    __m128i x = _mm_loadu_si128((const __m128i*) p);
+    // unpack each sample into the top of a lane, then shift it down to
+    // sign extend it
+    lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+    hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+}
+
+static inline void storeRowSse2(float* p, __m128 lo, __m128 hi) {
+    _mm_storeu_ps(p, lo);
+    _mm_storeu_ps(p + 4, hi);
+}
+
+static inline void storeRowSse2(double* p, __m128 lo, __m128 hi) {
+    _mm_storeu_pd(p, _mm_cvtps_pd(lo));
+    _mm_storeu_pd(p + 2, _mm_cvtps_pd(_mm_movehl_ps(lo, lo)));
+    _mm_storeu_pd(p + 4, _mm_cvtps_pd(hi));
+    _mm_storeu_pd(p + 6, _mm_cvtps_pd(_mm_movehl_ps(hi, hi)));
+}
+
+// rounds to nearest like fromDouble<int16_t>, and saturates
+static inline void storeRowSse2(int16_t* p, __m128 lo, __m128 hi) {
+    _mm_storeu_si128((__m128i*) p, _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi)));
+}
+
+// Transpose the block as four 4x4 transposes; the off-diagonal quarters
+// then swap places
+static inline void transposeSse2(__m128 lo[FAST_DCT_SIZE], __m128 hi[FAST_DCT_SIZE]) {
+    _MM_TRANSPOSE4_PS(lo[0], lo[1], lo[2], lo[3]);
+    _MM_TRANSPOSE4_PS(hi[0], hi[1], hi[2], hi[3]);
+    _MM_TRANSPOSE4_PS(lo[4], lo[5], lo[6], lo[7]);
+    _MM_TRANSPOSE4_PS(hi[4], hi[5], hi[6], hi[7]);
+    for (int i = 0; i < 4; i++) {
+        std::swap(hi[i], lo[i + 4]);
+    }
+}
+
+template <typename T>
+static void aanChannelSse2(Span<const T> in, Span<T> out, bool inverse, const float* reciprocals) {
+    __m128 lo[FAST_DCT_SIZE];
+    __m128 hi[FAST_DCT_SIZE];
+    for (int i = 0; i < FAST_DCT_SIZE; i++) {
+        loadRowSse2(in.data() + i * FAST_DCT_SIZE, lo[i], hi[i]);
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        if (inverse) {
+            aanInverse<float>(lo, 1);
+            aanInverse<float>(hi, 1);
+        } else {
+            aanForward<float>(lo, 1);
+            aanForward<float>(hi, 1);
+        }
+        transposeSse2(lo, hi);
+    }
+    // the inverse leaves the factor 8 of the 2-D inverse in
+    float scale = inverse ? 0.125f : 1.0f;
+    for (int i = 0; i < FAST_DCT_SIZE; i++) {
+        if (reciprocals) {
+            // round through integers, like roundToInteger() and every
+            // other level, so small negative values become +0, not -0
+            lo[i] = _mm_cvtepi32_ps(_mm_cvtps_epi32(lo[i] * _mm_loadu_ps(reciprocals + i * FAST_DCT_SIZE)));
+            hi[i] = _mm_cvtepi32_ps(_mm_cvtps_epi32(hi[i] * _mm_loadu_ps(reciprocals + i * FAST_DCT_SIZE + 4)));
+        }
+        storeRowSse2(out.data() + i * FAST_DCT_SIZE, lo[i] * scale, hi[i] * scale);
+    }
+}
+
+// AVX2 holds each row in one register
+
+__attribute__((target("avx2")))
+static inline __m256 loadRowAvx2(const float* p) {
+    return _mm256_loadu_ps(p);
+}
+
+__attribute__((target("avx2")))
+static inline __m256 loadRowAvx2(const double* p) {
+    __m128 lo = _mm256_cvtpd_ps(_mm256_loadu_pd(p));
+    __m128 hi = _mm256_cvtpd_ps(_mm256_loadu_pd(p + 4));
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+}
+
+__attribute__((target("avx2")))
+static inline __m256 loadRowAvx2(const int16_t* p) {
+    return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*) p)));
+}
+
+__attribute__((target("avx2")))
+static inline void storeRowAvx2(float* p, __m256 v) {
+    _mm256_storeu_ps(p, v);
+}
+
+__attribute__((target("avx2")))
+static inline void storeRowAvx2(double* p, __m256 v) {
+    _mm256_storeu_pd(p, _mm256_cvtps_pd(_mm256_castps256_ps128(v)));
+    _mm256_storeu_pd(p + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+}
+
+// rounds to nearest like fromDouble<int16_t>, and saturates
+__attribute__((target("avx2")))
+static inline void storeRowAvx2(int16_t* p, __m256 v) {
+    __m256i x = _mm256_cvtps_epi32(v);
+    _mm_storeu_si128((__m128i*) p, _mm_packs_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1)));
+}
+
+// Transpose the block: interleave pairs of rows, then pairs of pairs
+// within each 128-bit lane, then swap the lanes
+__attribute__((target("avx2")))
+static inline void transposeAvx2(__m256 r[FAST_DCT_SIZE]) {
+    __m256 t0 = _mm256_unpacklo_ps(r[0], r[1]);
+    __m256 t1 = _mm256_unpackhi_ps(r[0], r[1]);
+    __m256 t2 = _mm256_unpacklo_ps(r[2], r[3]);
+    __m256 t3 = _mm256_unpackhi_ps(r[2], r[3]);
+    __m256 t4 = _mm256_unpacklo_ps(r[4], r[5]);
+    __m256 t5 = _mm256_unpackhi_ps(r[4], r[5]);
+    __m256 t6 = _mm256_unpacklo_ps(r[6], r[7]);
+    __m256 t7 = _mm256_unpackhi_ps(r[6], r[7]);
+
+    __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+    r[0] = _mm256_permute2f128_ps(s0, s4, 0x20);
+    r[1] = _mm256_permute2f128_ps(s1, s5, 0x20);
+    r[2] = _mm256_permute2f128_ps(s2, s6, 0x20);
+    r[3] = _mm256_permute2f128_ps(s3, s7, 0x20);
+    r[4] = _mm256_permute2f128_ps(s0, s4, 0x31);
+    r[5] = _mm256_permute2f128_ps(s1, s5, 0x31);
+    r[6] = _mm256_permute2f128_ps(s2, s6, 0x31);
+    r[7] = _mm256_permute2f128_ps(s3, s7, 0x31);
+}
+
+template <typename T>
+__attribute__((target("avx2")))
+static void aanChannelAvx2(Span<const T> in, Span<T> out, bool inverse, const float* reciprocals) {
+    __m256 r[FAST_DCT_SIZE];
+    for (int i = 0; i < FAST_DCT_SIZE; i++) {
+        r[i] = loadRowAvx2(in.data() + i * FAST_DCT_SIZE);
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        if (inverse) {
+            aanInverse<float>(r, 1);
+        } else {
+            aanForward<float>(r, 1);
+        }
+        transposeAvx2(r);
+    }
+    float scale = inverse ? 0.125f : 1.0f;
+    for (int i = 0; i < FAST_DCT_SIZE; i++) {
+        if (reciprocals) {
+            r[i] = _mm256_cvtepi32_ps(_mm256_cvtps_epi32(r[i] * _mm256_loadu_ps(reciprocals + i * FAST_DCT_SIZE)));
+        }
+        storeRowAvx2(out.data() + i * FAST_DCT_SIZE, r[i] * scale);
+    }
+}
+
+// AVX-512 holds the same row of two channels in one register, channel
+// <a> in the low 256 bits and <b> in the high 256 bits, and transforms
+// both at once
+
+__attribute__((target("avx512f")))
+static inline __m512 joinHalves(__m256 a, __m256 b) {
+    return _mm512_castpd_ps(_mm512_insertf64x4(_mm512_castps_pd(_mm512_castps256_ps512(a)), _mm256_castps_pd(b), 1));
+}
+
+__attribute__((target("avx512f")))
+static inline __m256 highHalf(__m512 v) {
+    return _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1));
+}
+
+// Transpose both blocks, each within its own 256 bits, the same way as
+// transposeAvx2
+__attribute__((target("avx512f")))
+static inline void transposeAvx512(__m512 r[FAST_DCT_SIZE]) {
+    __m512 t0 = _mm512_unpacklo_ps(r[0], r[1]);
+    __m512 t1 = _mm512_unpackhi_ps(r[0], r[1]);
+    __m512 t2 = _mm512_unpacklo_ps(r[2], r[3]);
+    __m512 t3 = _mm512_unpackhi_ps(r[2], r[3]);
+    __m512 t4 = _mm512_unpacklo_ps(r[4], r[5]);
+    __m512 t5 = _mm512_unpackhi_ps(r[4], r[5]);
+    __m512 t6 = _mm512_unpacklo_ps(r[6], r[7]);
+    __m512 t7 = _mm512_unpackhi_ps(r[6], r[7]);
+
+    __m512 s0 = _mm512_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    __m512 s1 = _mm512_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m512 s2 = _mm512_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    __m512 s3 = _mm512_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    __m512 s4 = _mm512_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    __m512 s5 = _mm512_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    __m512 s6 = _mm512_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    __m512 s7 = _mm512_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+    // per 256 bits: low 128 bits of both sources, then high 128 bits
+    const __m512i low_lanes = _mm512_setr_epi32(0, 1, 2, 3, 16, 17, 18, 19, 8, 9, 10, 11, 24, 25, 26, 27);
+    const __m512i high_lanes = _mm512_setr_epi32(4, 5, 6, 7, 20, 21, 22, 23, 12, 13, 14, 15, 28, 29, 30, 31);
+    r[0] = _mm512_permutex2var_ps(s0, low_lanes, s4);
+    r[1] = _mm512_permutex2var_ps(s1, low_lanes, s5);
+    r[2] = _mm512_permutex2var_ps(s2, low_lanes, s6);
+    r[3] = _mm512_permutex2var_ps(s3, low_lanes, s7);
+    r[4] = _mm512_permutex2var_ps(s0, high_lanes, s4);
+    r[5] = _mm512_permutex2var_ps(s1, high_lanes, s5);
+    r[6] = _mm512_permutex2var_ps(s2, high_lanes, s6);
+    r[7] = _mm512_permutex2var_ps(s3, high_lanes, s7);
+}
+
+template <typename T>
+__attribute__((target("avx512f")))
+static void aanChannelPairAvx512(Span<const T> in_a, Span<T> out_a, Span<const T> in_b, Span<T> out_b, bool inverse,
+                                 const float* reciprocals) {
+    __m512 r[FAST_DCT_SIZE];
+    for (int i = 0; i < FAST_DCT_SIZE; i++) {
+        r[i] = joinHalves(loadRowAvx2(in_a.data() + i * FAST_DCT_SIZE), loadRowAvx2(in_b.data() + i * FAST_DCT_SIZE));
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        if (inverse) {
+            aanInverse<float>(r, 1);
+        } else {
+            aanForward<float>(r, 1);
+        }
+        transposeAvx512(r);
+    }
+    float scale = inverse ? 0.125f : 1.0f;
+    for (int i = 0; i < FAST_DCT_SIZE; i++) {
+        if (reciprocals) {
+            __m256 row = _mm256_loadu_ps(reciprocals + i * FAST_DCT_SIZE);
+            r[i] = _mm512_cvtepi32_ps(_mm512_cvtps_epi32(r[i] * joinHalves(row, row)));
+        }
+        __m512 v = r[i] * scale;
+        storeRowAvx2(out_a.data() + i * FAST_DCT_SIZE, _mm512_castps512_ps256(v));
+        storeRowAvx2(out_b.data() + i * FAST_DCT_SIZE, highHalf(v));
+    }
+}
+
+// Block <b> of a run of NxN blocks
+template <typename T, int N>
+static inline Span<T> blockOf(Span<T> blocks, int b) {
+    return Span<T>(blocks.data() + (size_t) b * N * N, N * N);
+}
+
+// AAN transform of a run of <num_blocks> blocks with the widest
+// instruction set this CPU has
+template <typename T>
+static void aanBlocksSimd(Span<const T> in, Span<T> out, int num_blocks, bool inverse, const float* reciprocals) {
+    int b = 0;
+    if (simd_level == SIMD_AVX512) {
+        // blocks go through side by side, two to a register
+        for (; b + 1 < num_blocks; b += 2) {
+            aanChannelPairAvx512(blockOf<const T, FAST_DCT_SIZE>(in, b), blockOf<T, FAST_DCT_SIZE>(out, b),
+                blockOf<const T, FAST_DCT_SIZE>(in, b + 1), blockOf<T, FAST_DCT_SIZE>(out, b + 1), inverse, reciprocals);
+        }
+    }
+    for (; b < num_blocks; b++) {
+        if (simd_level >= SIMD_AVX2) {
+            aanChannelAvx2(blockOf<const T, FAST_DCT_SIZE>(in, b), blockOf<T, FAST_DCT_SIZE>(out, b), inverse, reciprocals);
+        } else {
+            aanChannelSse2(blockOf<const T, FAST_DCT_SIZE>(in, b), blockOf<T, FAST_DCT_SIZE>(out, b), inverse, reciprocals);
+        }
+    }
+}
+
+// Fixed-point constants of the LLM kernels: FIX(x) = x * 2^LLM_CONST_BITS.
+// The first pass keeps LLM_PASS1_BITS extra bits of precision.
+#define LLM_CONST_BITS 13
+#define LLM_PASS1_BITS 2
+#define FIX_0_298631336 ((int32_t) 2446)
+#define FIX_0_390180644 ((int32_t) 3196)
+#define FIX_0_541196100 ((int32_t) 4433)
+#define FIX_0_765366865 ((int32_t) 6270)
+#define FIX_0_899976223 ((int32_t) 7373)
+#define FIX_1_175875602 ((int32_t) 9633)
+#define FIX_1_501321110 ((int32_t) 12299)
+#define FIX_1_847759065 ((int32_t) 15137)
+#define FIX_1_961570560 ((int32_t) 16069)
+#define FIX_2_053119869 ((int32_t) 16819)
+#define FIX_2_562915447 ((int32_t) 20995)
+#define FIX_3_072711026 ((int32_t) 25172)
+
+// Samples are centred on zero before the LLM kernels, as in JPEG, so
+// their fixed-point products stay within 32 bits
+#define LLM_CENTRE 128
+
+// Divide by 2^n, rounding to nearest
+static inline int32_t descale(int32_t x, int n) {
+    return (x + (1 << (n - 1))) >> n;
+}
+
+// LLM 8-point forward DCT in place. The first (row) pass leaves its
+// outputs scaled up by 2^LLM_PASS1_BITS, which the second (column) pass
+// takes back out; outputs are scaled as dctForwardScale(DCT_LLM).
+static void llmForward(int32_t* d, int stride, bool first_pass) {
+    int shift = first_pass ? LLM_CONST_BITS - LLM_PASS1_BITS : LLM_CONST_BITS + LLM_PASS1_BITS;
+
+    int32_t tmp0 = d[0] + d[7 * stride];
+    int32_t tmp7 = d[0] - d[7 * stride];
+    int32_t tmp1 = d[stride] + d[6 * stride];
+    int32_t tmp6 = d[stride] - d[6 * stride];
+    int32_t tmp2 = d[2 * stride] + d[5 * stride];
+    int32_t tmp5 = d[2 * stride] - d[5 * stride];
+    int32_t tmp3 = d[3 * stride] + d[4 * stride];
+    int32_t tmp4 = d[3 * stride] - d[4 * stride];
+
+    // even part
+    int32_t tmp10 = tmp0 + tmp3;
+    int32_t tmp13 = tmp0 - tmp3;
+    int32_t tmp11 = tmp1 + tmp2;
+    int32_t tmp12 = tmp1 - tmp2;
+
+    if (first_pass) {
+        d[0] = (tmp10 + tmp11) << LLM_PASS1_BITS;
+        d[4 * stride] = (tmp10 - tmp11) << LLM_PASS1_BITS;
+    } else {
+        d[0] = descale(tmp10 + tmp11, LLM_PASS1_BITS);
+        d[4 * stride] = descale(tmp10 - tmp11, LLM_PASS1_BITS);
+    }
+
+    int32_t z1 = (tmp12 + tmp13) * FIX_0_541196100;
+    d[2 * stride] = descale(z1 + tmp13 * FIX_0_765366865, shift);
+    d[6 * stride] = descale(z1 - tmp12 * FIX_1_847759065, shift);
+
+    // odd part
+    z1 = tmp4 + tmp7;
+    int32_t z2 = tmp5 + tmp6;
+    int32_t z3 = tmp4 + tmp6;
+    int32_t z4 = tmp5 + tmp7;
+    int32_t z5 = (z3 + z4) * FIX_1_175875602;
+
+    tmp4 *= FIX_0_298631336;
+    tmp5 *= FIX_2_053119869;
+    tmp6 *= FIX_3_072711026;
+    tmp7 *= FIX_1_501321110;
+    z1 *= -FIX_0_899976223;
+    z2 *= -FIX_2_562915447;
+    z3 = z3 * -FIX_1_961570560 + z5;
+    z4 = z4 * -FIX_0_390180644 + z5;
+
+    d[7 * stride] = descale(tmp4 + z1 + z3, shift);
+    d[5 * stride] = descale(tmp5 + z2 + z4, shift);
+    d[3 * stride] = descale(tmp6 + z2 + z3, shift);
+    d[stride] = descale(tmp7 + z1 + z4, shift);
+}
+
+// LLM 8-point inverse DCT in place. The first (column) pass keeps
+// LLM_PASS1_BITS extra bits, the second (row) pass also divides out the
+// factor 8 of the 2-D inverse.
+static void llmInverse(int32_t* d, int stride, bool first_pass) {
+    int shift = first_pass ? LLM_CONST_BITS - LLM_PASS1_BITS : LLM_CONST_BITS + LLM_PASS1_BITS + 3;
+
+    // even part
+    int32_t z2 = d[2 * stride];
+    int32_t z3 = d[6 * stride];
+    int32_t z1 = (z2 + z3) * FIX_0_541196100;
+    int32_t tmp2 = z1 - z3 * FIX_1_847759065;
+    int32_t tmp3 = z1 + z2 * FIX_0_765366865;
+
+    int32_t tmp0 = (d[0] + d[4 * stride]) << LLM_CONST_BITS;
+    int32_t tmp1 = (d[0] - d[4 * stride]) << LLM_CONST_BITS;
+
+    int32_t tmp10 = tmp0 + tmp3;
+    int32_t tmp13 = tmp0 - tmp3;
+    int32_t tmp11 = tmp1 + tmp2;
+    int32_t tmp12 = tmp1 - tmp2;
+
+    // odd part
+    tmp0 = d[7 * stride];
+    tmp1 = d[5 * stride];
+    tmp2 = d[3 * stride];
+    tmp3 = d[stride];
+
+    z1 = tmp0 + tmp3;
+    z2 = tmp1 + tmp2;
+    z3 = tmp0 + tmp2;
+    int32_t z4 = tmp1 + tmp3;
+    int32_t z5 = (z3 + z4) * FIX_1_175875602;
+
+    tmp0 *= FIX_0_298631336;
+    tmp1 *= FIX_2_053119869;
+    tmp2 *= FIX_3_072711026;
+    tmp3 *= FIX_1_501321110;
+    z1 *= -FIX_0_899976223;
+    z2 *= -FIX_2_562915447;
+    z3 = z3 * -FIX_1_961570560 + z5;
+    z4 = z4 * -FIX_0_390180644 + z5;
+
+    tmp0 += z1 + z3;
+    tmp1 += z2 + z4;
+    tmp2 += z2 + z3;
+    tmp3 += z1 + z4;
+
+    d[0] = descale(tmp10 + tmp3, shift);
+    d[7 * stride] = descale(tmp10 - tmp3, shift);
+    d[stride] = descale(tmp11 + tmp2, shift);
+    d[6 * stride] = descale(tmp11 - tmp2, shift);
+    d[2 * stride] = descale(tmp12 + tmp1, shift);
+    d[5 * stride] = descale(tmp12 - tmp1, shift);
+    d[3 * stride] = descale(tmp13 + tmp0, shift);
+    d[4 * stride] = descale(tmp13 - tmp0, shift);
+}
+
+template <typename T>
+static void llmDctChannel(Span<const T> in, Span<T> out, const double* reciprocals) {
+    int32_t d[FAST_DCT_PIXELS];
+    for (int i = 0; i < FAST_DCT_PIXELS; i++) {
+        d[i] = (int32_t) lrint(in[i]) - LLM_CENTRE;
+    }
+    for (int i = 0; i < FAST_DCT_SIZE; i++) {
+        llmForward(d + i * FAST_DCT_SIZE, 1, true);
+    }
+    for (int i = 0; i < FAST_DCT_SIZE; i++) {
+        llmForward(d + i, FAST_DCT_SIZE, false);
+    }
+    // put back the DC of the centring, scaled like the outputs
+    d[0] += LLM_CENTRE * FAST_DCT_PIXELS;
+    storeCoefficients<FAST_DCT_PIXELS>(out, d, reciprocals);
+}
+
+template <typename T>
+static void llmIdctChannel(Span<const T> in, Span<T> out) {
+    int32_t d[FAST_DCT_PIXELS];
+    for (int i = 0; i < FAST_DCT_PIXELS; i++) {
+        d[i] = (int32_t) lrint(in[i]);
+    }
+    d[0] -= LLM_CENTRE * FAST_DCT_SIZE;
+    for (int i = 0; i < FAST_DCT_SIZE; i++) {
+        llmInverse(d + i, FAST_DCT_SIZE, true);
+    }
+    for (int i = 0; i < FAST_DCT_SIZE; i++) {
+        llmInverse(d + i * FAST_DCT_SIZE, 1, false);
+    }
+    for (int i = 0; i < FAST_DCT_PIXELS; i++) {
+        out[i] = fromDouble<T>(d[i] + LLM_CENTRE);
+    }
+}
+
+// The 8-point kernels only transform FAST_DCT_SIZE blocks; every other
+// block size runs the matrix kernel. N is a constant, so each
+// instantiation keeps just the branch it can take.
+template <typename T, int N>
+static void dctChannel(Span<const T> in, Span<T> out, DctKernel kernel, const double* reciprocals) {
+    switch (N == FAST_DCT_SIZE ? kernel : DCT_MATRIX) {
+        case DCT_AAN:
+            aanDctChannel(in, out, reciprocals);
+            break;
+        case DCT_LLM:
+            llmDctChannel(in, out, reciprocals);
+            break;
+        default:
+            matrixDctChannel<T, N>(in, out, reciprocals);
+            break;
+    }
+}
+
+template <typename T, int N>
+static void idctChannel(Span<const T> in, Span<T> out, DctKernel kernel) {
+    switch (N == FAST_DCT_SIZE ? kernel : DCT_MATRIX) {
+        case DCT_AAN:
+            aanIdctChannel(in, out);
+            break;
+        case DCT_LLM:
+            llmIdctChannel(in, out);
+            break;
+        default:
+            matrixIdctChannel<T, N>(in, out);
+            break;
+    }
+}
+
+// Forward DCT operation for a run of NxN blocks
+// Reads <in> and writes <out>, which may be the same blocks.
+template <typename T, int N>
+void DCT(Span<const T> in, Span<T> out, DctKernel kernel, const ReciprocalTable<N>* reciprocals) {
+    int num_blocks = in.size() / (N * N);
+    if (N == FAST_DCT_SIZE && kernel == DCT_AAN && simd_level != SIMD_NONE) {
+        aanBlocksSimd(in, out, num_blocks, false, reciprocals ? reciprocals->single : NULL);
+        return;
+    }
+    const double* full = reciprocals ? reciprocals->full : NULL;
+    for (int b = 0; b < num_blocks; b++) {
+        dctChannel<T, N>(blockOf<const T, N>(in, b), blockOf<T, N>(out, b), kernel, full);
+    }
+}
+
+// Inverse DCT operation for a run of NxN blocks
+// Reads <in> and writes <out>, which may be the same blocks.
+template <typename T, int N>
+void IDCT(Span<const T> in, Span<T> out, DctKernel kernel) {
+    int num_blocks = in.size() / (N * N);
+    if (N == FAST_DCT_SIZE && kernel == DCT_AAN && simd_level != SIMD_NONE) {
+        aanBlocksSimd(in, out, num_blocks, true, NULL);
+        return;
+    }
+    for (int b = 0; b < num_blocks; b++) {
+        idctChannel<T, N>(blockOf<const T, N>(in, b), blockOf<T, N>(out, b), kernel);
+    }
+}
+
+template <typename T, int N>
+void scaledIDCT(Span<const T> in, Span<T> out, int scale) {
+    switch (scale) {
+        case 1:
+            matrixIdctChannel<T, N>(in, out);
+            break;
+        case 2:
+            scaledIdctChannel<T, N, N / 2>(in, out);
+            break;
+        case 4:
+            scaledIdctChannel<T, N, N / 4>(in, out);
+            break;
+        default:
+            // 1/8 is only valid from 8x8 blocks up; at 8x8 it is the DC alone
+            scaledIdctChannel<T, N, (N >= 8 ? N / 8 : 1)>(in, out);
+            break;
+    }
+}
+
+// Inverse transform of an NxN channel whose nonzero coefficients all lie
+// in its top-left KxK corner, columns then rows like matrixIdctChannel()
+// but over those K frequencies only. Each coefficient scales a whole
+// basis row into the sums, so the inner loops run over N samples and
+// vectorize. <unscale>[k] takes the kernel's inverse scale out of the
+// coefficients of frequency k, down or across.
+template <typename T, int N, int K>
+static void sparseIdctChannel(Span<const T> in, Span<T> out, const double* unscale) {
+    const std::array<double, N * N>& basis = BlockTables<N>::basis;
+    // cols[q * N + m]: column q transformed, at row m
+    double cols[K * N] = {0};
+
+    for (int p = 0; p < K; p++) {
+        for (int q = 0; q < K; q++) {
+            double coeff = in[p * N + q] * unscale[p] * unscale[q];
+            for (int m = 0; m < N; m++) {
+                cols[q * N + m] += coeff * basis[p * N + m];
+            }
+        }
+    }
+
+    for (int m = 0; m < N; m++) {
+        double row[N] = {0};
+        for (int q = 0; q < K; q++) {
+            double col = cols[q * N + m];
+            for (int n = 0; n < N; n++) {
+                row[n] += col * basis[q * N + n];
+            }
+        }
+        for (int n = 0; n < N; n++) {
+            out[m * N + n] = fromDouble<T>(row[n]);
+        }
+    }
+}
+
+// Factors taking each kernel's inverse scale out of the coefficients of
+// one frequency: the scale of coefficient (u, v) is the product of those
+// of u and v, so factor k is one over the square root of the scale of
+// (k, k)
+template <int N>
+struct InverseUnscaleTables {
+    double factors[NUM_DCT_KERNELS][N];
+
+    InverseUnscaleTables() {
+        for (int k = 0; k < NUM_DCT_KERNELS; k++) {
+            DctKernel kernel = N == FAST_DCT_SIZE ? (DctKernel) k : DCT_MATRIX;
+            for (int i = 0; i < N; i++) {
+                factors[k][i] = 1.0 / sqrt(dctInverseScale(kernel, i * N + i));
+            }
+        }
+    }
+};
+
+static const char* idct_shape_names[NUM_IDCT_SHAPES] = {"DC only", "2x2", "4x4", "full"};
+
+const char* idctShapeName(IdctShape shape) {
+    return idct_shape_names[shape];
+}
+
+// Shape of the transform a block of coefficients of <extent> takes at
+// 1/<scale> size with <kernel>; a block scaled down to one sample keeps
+// only its DC, the scaled transform already reads only the frequencies it
+// keeps, and the vector AAN kernel does a whole block in less time than
+// the scalar sums of a corner
+template <int N>
+static IdctShape idctShape(int extent, int scale, DctKernel kernel) {
+    if (extent <= 1 || N / std::min(scale, N) == 1) {
+        return IDCT_DC_ONLY;
+    }
+    if (scale > 1 || (N == FAST_DCT_SIZE && kernel == DCT_AAN && simd_level != SIMD_NONE)) {
+        return IDCT_FULL;
+    }
+    if (extent <= 2 && N > 2) {
+        return IDCT_2X2;
+    }
+    if (extent <= 4 && N > 4) {
+        return IDCT_4X4;
+    }
+    return IDCT_FULL;
+}
+
+// Inverse DCT of part of a plane: blocks that need the full transform go
+// through the kernel a run at a time, the others one by one
+template <typename T, int N>
+void idctBlocks(BlockPlane<T>& plane, int first, int count, DctKernel kernel, int scale,
+                int shapes[NUM_IDCT_SHAPES]) {
 
-            double tmp_y, tmp_cb, tmp_cr;
-            tmp_y = 0;
-            tmp_cb = 0;
-            tmp_cr = 0;
+    static const InverseUnscaleTables<N> unscale_tables;
+    const double* unscale = unscale_tables.factors[kernel];
+    // a reduced size block is K x K samples at its start
+    int size = N / std::min(scale, N);
+    int end = first + count;
+    int i = first;
+    while (i < end) {
+        IdctShape shape = idctShape<N>(plane.extent[i], scale, kernel);
+        if (shape != IDCT_FULL) {
+            Span<T> block = plane.blocks(i);
+            if (shape == IDCT_DC_ONLY) {
+                // the orthonormal DC coefficient of N x N samples of value v is N v
+                T value = fromDouble<T>(block[0] * unscale[0] * unscale[0] / N);
+                std::fill(block.begin(), block.begin() + size * size, value);
+            } else if (shape == IDCT_2X2) {
+                sparseIdctChannel<T, N, 2>(block, block, unscale);
+            } else {
+                sparseIdctChannel<T, N, (N > 4 ? 4 : N)>(block, block, unscale);
+            }
+            shapes[shape]++;
+            i++;
+            continue;
+        }
+        int run_end = i + 1;
+        while (run_end < end && idctShape<N>(plane.extent[run_end], scale, kernel) == IDCT_FULL) {
+            run_end++;
+        }
+        if (scale > 1) {
+            for (int b = i; b < run_end; b++) {
+                scaledIDCT<T, N>(plane.blocks(b), plane.blocks(b), scale);
+            }
+        } else {
+            Span<T> run = plane.blocks(i, run_end - i);
+            IDCT<T, N>(run, run, kernel);
+        }
+        shapes[IDCT_FULL] += run_end - i;
+        i = run_end;
+    }
+}
+
+// Reference forward DCT of one NxN channel, straight from the definition:
+// F(p, q) = a(p) a(q) sum_m sum_n f(m, n) cos((2m+1)p pi/2N) cos((2n+1)q pi/2N)
+static void referenceDCT(const double* f, double* F, int block_size) {
+    for (int p = 0; p < block_size; p++) {
+        for (int q = 0; q < block_size; q++) {
+            double ap = (p > 0) ? sqrt(2.0 / block_size) : sqrt(1.0 / block_size);
+            double aq = (q > 0) ? sqrt(2.0 / block_size) : sqrt(1.0 / block_size);
+            double sum = 0;
+            for (int m = 0; m < block_size; m++) {
+                for (int n = 0; n < block_size; n++) {
+                    sum += f[sub2ind(block_size, n, m)]
+                        * cos((2*m + 1) * p * M_PI / (2 * block_size))
+                        * cos((2*n + 1) * q * M_PI / (2 * block_size));
+                }
+            }
+            F[sub2ind(block_size, q, p)] = ap * aq * sum;
+        }
+    }
+}
 
-            // Input: F(p, q)
+// Reference inverse DCT of one NxN channel, straight from the definition
+static void referenceIDCT(const double* F, double* f, int block_size) {
+    for (int m = 0; m < block_size; m++) {
+        for (int n = 0; n < block_size; n++) {
+            double sum = 0;
             for (int p = 0; p < block_size; p++) {
                 for (int q = 0; q < block_size; q++) {
-                    double ap = (p > 0) ? (sqrt(2/block_size)) : (1/sqrt(block_size));
-                    double aq = (q > 0) ? (sqrt(2/block_size)) : (1/sqrt(block_size));
-                    int vectorized_idx_pq = sub2ind(block_size, q, p);
-                    std::shared_ptr<PixelYcbcr> f_pq = pixels[vectorized_idx_pq];
-
-                    double xprod = cos((2*m + 1)*p*M_PI/(2*block_size));
-                    double yprod = cos((2*n + 1)*q*M_PI/(2*block_size));
-
-                    tmp_y += (ap * aq * (f_pq->y) * xprod * yprod);
-                    if (all) {
-                        tmp_cr += (ap * aq * (f_pq->cr) * xprod * yprod);
-                        tmp_cb += (ap * aq * (f_pq->cb) * xprod * yprod);
-                    }
+                    double ap = (p > 0) ? sqrt(2.0 / block_size) : sqrt(1.0 / block_size);
+                    double aq = (q > 0) ? sqrt(2.0 / block_size) : sqrt(1.0 / block_size);
+                    sum += ap * aq * F[sub2ind(block_size, q, p)]
+                        * cos((2*m + 1) * p * M_PI / (2 * block_size))
+                        * cos((2*n + 1) * q * M_PI / (2 * block_size));
                 }
             }
+            f[sub2ind(block_size, n, m)] = sum;
+        }
+    }
+}
 
-            f[vectorized_idx_mn] = std::make_shared<PixelYcbcr>();
-            f[vectorized_idx_mn]->y = tmp_y;
-            if (all) {
-                f[vectorized_idx_mn]->cr = tmp_cr;
-                f[vectorized_idx_mn]->cb = tmp_cb;
-            } else {
-                f[vectorized_idx_mn]->cr = 0;
-                f[vectorized_idx_mn]->cb = 0;
-            }
+template <int N>
+double dctReferenceError(DctKernel kernel, int num_blocks) {
+    // the scales of the fast kernels only apply where they run
+    DctKernel scaled = N == FAST_DCT_SIZE ? kernel : DCT_MATRIX;
+    double max_error = 0;
+    unsigned int seed = 1;
+    for (int b = 0; b < num_blocks; b++) {
+        double pixels[N * N];
+        double coeffs[N * N];
+        double expected[N * N];
+        double recovered[N * N];
+        for (int i = 0; i < N * N; i++) {
+            // small LCG, so every run checks the same pixels
+            seed = seed * 1103515245 + 12345;
+            pixels[i] = (seed >> 16) % 256;
+        }
+        Span<double> block(coeffs, N * N);
+
+        std::copy(pixels, pixels + N * N, coeffs);
+        DCT<double, N>(block, block, kernel);
+        referenceDCT(pixels, expected, N);
+        for (int i = 0; i < N * N; i++) {
+            max_error = std::max(max_error, fabs(coeffs[i] / dctForwardScale(scaled, i) - expected[i]));
+        }
+
+        // the inverse starts from the reference coefficients, scaled the
+        // way the kernel expects them
+        for (int i = 0; i < N * N; i++) {
+            coeffs[i] = expected[i] * dctInverseScale(scaled, i);
+        }
+        IDCT<double, N>(block, block, kernel);
+        referenceIDCT(expected, recovered, N);
+        for (int i = 0; i < N * N; i++) {
+            max_error = std::max(max_error, fabs(coeffs[i] - recovered[i]));
         }
     }
-    return f;
+    return max_error;
 }
+
+#define INSTANTIATE_DCT_SIZE(T, N) \
+    template void DCT<T, N>(Span<const T> in, Span<T> out, DctKernel kernel, const ReciprocalTable<N>* reciprocals); \
+    template void IDCT<T, N>(Span<const T> in, Span<T> out, DctKernel kernel); \
+    template void scaledIDCT<T, N>(Span<const T> in, Span<T> out, int scale); \
+    template void idctBlocks<T, N>(BlockPlane<T>& plane, int first, int count, DctKernel kernel, int scale, \
+                                   int shapes[NUM_IDCT_SHAPES]);
+#define INSTANTIATE_DCT(T) FOR_EACH_BLOCK_SIZE(INSTANTIATE_DCT_SIZE, T)
+
+FOR_EACH_SAMPLE_TYPE(INSTANTIATE_DCT)
+
+#define INSTANTIATE_DCT_CHECK(T, N) \
+    template double dctReferenceError<N>(DctKernel kernel, int num_blocks);
+
+FOR_EACH_BLOCK_SIZE(INSTANTIATE_DCT_CHECK, )
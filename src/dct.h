@@ -3,15 +3,131 @@
 #endif
 
 #include "math.h"
+#include <string>
 #include "image.h"
+#include "blocktables.h"
 
-// Forward DCT operation for NxN block
-// If <all> set, then YCbCr each have DCT performed on them.
-// Else, only Y has DCT performed on it.
-std::vector<std::shared_ptr<PixelYcbcr>> DCT(std::vector<std::shared_ptr<PixelYcbcr>> pixels, int block_size, bool all);
+#ifndef DCT_H
+#define DCT_H
 
-// Inverse DCT operation for NxN block
-// If <all> set, then YCbCr each have IDCT performed on them.
-// Else, only Y has IDCT performed on it.
-std::vector<std::shared_ptr<PixelYcbcr>> IDCT(std::vector<std::shared_ptr<PixelYcbcr>> pixels, int block_size, bool all);
+// Block size the 8-point kernels transform; other block sizes always
+// use the matrix kernel
+#define FAST_DCT_SIZE 8
+#define FAST_DCT_PIXELS (FAST_DCT_SIZE * FAST_DCT_SIZE)
 
+// 8-point transform the DCT and IDCT run on each block row and column
+enum DctKernel {
+    DCT_MATRIX, // basis matrix product, exact in floating point
+    DCT_AAN,    // Arai-Agui-Nakajima floating point, scale left to the quantizer
+    DCT_LLM,    // Loeffler-Ligtenberg-Moschytz fixed point, 12 multiplies per pass
+    NUM_DCT_KERNELS
+};
+
+const char* dctKernelName(DctKernel kernel);
+// Kernel called <name>; returns false if there is none
+bool parseDctKernel(const std::string& name, DctKernel& kernel);
+
+// Instruction sets the AAN kernel has vector code for, narrowest first
+enum SimdLevel {
+    SIMD_NONE,   // scalar double precision
+    SIMD_SSE2,
+    SIMD_AVX2,
+    SIMD_AVX512,
+    NUM_SIMD_LEVELS
+};
+
+// Widest level this CPU supports, from CPUID
+SimdLevel detectSimdLevel();
+// Level the transforms use; detectSimdLevel() unless set lower
+SimdLevel dctSimdLevel();
+// Use <level> from now on; returns false if the CPU doesn't support it
+bool setDctSimdLevel(SimdLevel level);
+const char* simdLevelName(SimdLevel level);
+bool parseSimdLevel(const std::string& name, SimdLevel& level);
+
+// Name of what <kernel> runs as on this CPU, e.g. "aan/avx2"
+const char* dctImplementationName(DctKernel kernel);
+
+// The fast kernels don't produce the orthonormal DCT itself: coefficient
+// <idx> of <kernel>'s forward output is the true coefficient times
+// dctForwardScale(), and its inverse expects the true coefficient times
+// dctInverseScale(). The quantizer folds both into its tables. Only
+// FAST_DCT_SIZE blocks are scaled.
+double dctForwardScale(DctKernel kernel, int idx);
+double dctInverseScale(DctKernel kernel, int idx);
+
+// Reciprocals of the quantization steps of an NxN block, with the forward
+// scale of the kernel they are for folded in: <full> for the double
+// precision kernels, <single> for the SIMD ones
+template <int N>
+struct ReciprocalTable {
+    double full[N * N];
+    float single[N * N];
+};
+
+// Blocks of a component the drivers hand the transforms at a time: the
+// AVX-512 AAN kernel transforms them in pairs, and a run amortizes the
+// kernel dispatch
+#define DCT_RUN_BLOCKS 16
+
+// Forward DCT operation for NxN blocks of one component
+// Reads <in> and writes <out>, which may be the same blocks: a single
+// block, or a run of whole blocks stored one after another as in a
+// BlockPlane.
+// N is the block size, one of FOR_EACH_BLOCK_SIZE.
+// Given <reciprocals>, the blocks are quantized in the same pass: each
+// coefficient is multiplied by its reciprocal step and rounded to the
+// nearest integer as it is written.
+template <typename T, int N>
+void DCT(Span<const T> in, Span<T> out, DctKernel kernel = DCT_MATRIX,
+         const ReciprocalTable<N>* reciprocals = NULL);
+
+// Inverse DCT operation for NxN blocks of one component
+// Reads <in> and writes <out>, which may be the same blocks: a single
+// block or a run of them, as for DCT().
+template <typename T, int N>
+void IDCT(Span<const T> in, Span<T> out, DctKernel kernel = DCT_MATRIX);
+
+// Inverse DCT of one NxN channel at 1/<scale> of its size, <scale> 1, 2,
+// 4 or 8 and at most N: only the KxK lowest frequencies, K = N / scale,
+// are transformed, giving the block low-pass filtered and decimated (at
+// 1/8 of an 8x8 block, its DC value alone). <in> holds orthonormal
+// (DCT_MATRIX) coefficients; the KxK result is written row-major to the
+// start of <out>, which may be <in>.
+template <typename T, int N>
+void scaledIDCT(Span<const T> in, Span<T> out, int scale);
+
+// Inverse transforms idctBlocks() picks from the extent of a block's
+// nonzero coefficients
+enum IdctShape {
+    IDCT_DC_ONLY, // no transform, every sample the DC value's
+    IDCT_2X2,     // top-left 2x2 coefficients
+    IDCT_4X4,     // top-left 4x4 coefficients
+    IDCT_FULL,    // the kernel's own transform, or scaledIDCT()
+    NUM_IDCT_SHAPES
+};
+
+const char* idctShapeName(IdctShape shape);
+
+// Inverse DCT of blocks [first, first + count) of <plane>, each by the
+// cheapest transform its extent allows: a block of extent 1 is filled
+// with the sample value of its DC coefficient, and one of extent 2 or 4
+// only sums the basis functions of its top-left corner. The rest take
+// IDCT() with <kernel> at full size, scaledIDCT() at 1/<scale>. At
+// reduced size, and with the vector AAN kernel, only DC only blocks are
+// singled out. The number of blocks of each IdctShape is added to
+// <shapes>.
+template <typename T, int N>
+void idctBlocks(BlockPlane<T>& plane, int first, int count, DctKernel kernel, int scale,
+                int shapes[NUM_IDCT_SHAPES]);
+
+// Number of blocks the drivers check the transform against the reference on
+#define DCT_CHECK_BLOCKS 16
+
+// Largest difference between <kernel>'s DCT/IDCT of NxN blocks, with its
+// scale taken out, and a transform computed straight from the
+// definition, over <num_blocks> fixed pseudo-random blocks
+template <int N>
+double dctReferenceError(DctKernel kernel, int num_blocks);
+
+#endif
@@ -5,23 +5,50 @@
 // Updates macroblocks to encode DC values i.e. (0,0) in each block
 // as a series of deltas, where first block value is an actual value.
 //
-// Updates values in-place.
-void DPCM(std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> blocks) {
-    for (unsigned int i = blocks.size() - 1; i > 0; i--) {
-        std::shared_ptr<PixelYcbcr> prev = blocks[i-1][0];
-        std::shared_ptr<PixelYcbcr> curr = blocks[i][0];
-        blocks[i][0]->y = curr->y - prev->y;
-        blocks[i][0]->cr = curr->cr - prev->cr;
-        blocks[i][0]->cb = curr->cb - prev->cb;
+// Updates values in-place, in every component the blocks have, each in
+// its own coding order. The deltas are taken between integer
+// coefficients, so they are exact whatever the sample type.
+template <typename T>
+void DPCM(ImageBlocks<T>& blocks) {
+    for (int chan = 0; chan < blocks.numComponents; chan++) {
+        BlockPlane<T>& plane = blocks.component(chan);
+        for (int i = plane.numBlocks - 1; i > 0; i--) {
+            plane.block(i)[0] = static_cast<T>(toCoefficient(plane.block(i)[0]) - toCoefficient(plane.block(i-1)[0]));
+        }
     }
 }
 
-void unDPCM(std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> blocks) {
-    for (unsigned int i = 1; i < blocks.size(); i++) {
-        std::shared_ptr<PixelYcbcr> prev = blocks[i-1][0];
-        std::shared_ptr<PixelYcbcr> curr = blocks[i][0];
-        blocks[i][0]->y = curr->y + prev->y;
-        blocks[i][0]->cr = curr->cr + prev->cr;
-        blocks[i][0]->cb = curr->cb + prev->cb;
+template <typename T>
+void DPCM(ImageBlocks<T>& blocks, Coefficient prev_dc[3]) {
+    if (blocks.numMcus == 0) {
+        return;
+    }
+    Coefficient last_dc[3];
+    for (int chan = 0; chan < blocks.numComponents; chan++) {
+        const BlockPlane<T>& plane = blocks.component(chan);
+        last_dc[chan] = toCoefficient(plane.block(plane.numBlocks - 1)[0]);
+    }
+    DPCM(blocks);
+    for (int chan = 0; chan < blocks.numComponents; chan++) {
+        T* first = blocks.component(chan).block(0);
+        first[0] = static_cast<T>(toCoefficient(first[0]) - prev_dc[chan]);
+        prev_dc[chan] = last_dc[chan];
     }
 }
+
+template <typename T>
+void unDPCM(ImageBlocks<T>& blocks) {
+    for (int chan = 0; chan < blocks.numComponents; chan++) {
+        BlockPlane<T>& plane = blocks.component(chan);
+        for (int i = 1; i < plane.numBlocks; i++) {
+            plane.block(i)[0] = static_cast<T>(toCoefficient(plane.block(i)[0]) + toCoefficient(plane.block(i-1)[0]));
+        }
+    }
+}
+
+#define INSTANTIATE_DPCM(T) \
+    template void DPCM<T>(ImageBlocks<T>& blocks); \
+    template void DPCM<T>(ImageBlocks<T>& blocks, Coefficient prev_dc[3]); \
+    template void unDPCM<T>(ImageBlocks<T>& blocks);
+
+FOR_EACH_SAMPLE_TYPE(INSTANTIATE_DPCM)
@@ -2,5 +2,14 @@
 #include <memory>
 #include "image.h"
 
-void DPCM(std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> blocks);
-void unDPCM(std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> blocks);
+template <typename T>
+void DPCM(ImageBlocks<T>& blocks);
+// DPCM of a range of blocks that continues an earlier range: block 0 is
+// coded against <prev_dc> (Y, Cr, Cb of the previous range's last block),
+// which is then updated to this range's last DC values. Grayscale blocks
+// only use and update prev_dc[COLOR_Y].
+// The blocks are quantized, so DC values are differenced as Coefficients.
+template <typename T>
+void DPCM(ImageBlocks<T>& blocks, Coefficient prev_dc[3]);
+template <typename T>
+void unDPCM(ImageBlocks<T>& blocks);
@@ -1,208 +1,536 @@
 #include "stdio.h"
+#include "stdlib.h"
+#include <algorithm>
 #include "image.h"
+#include "lodepng/lodepng.h"
 
 #define DEFAULT_ALPHA 255
 
-std::shared_ptr<ImageRgb> convertBytesToImage(std::vector<unsigned char> bytes, unsigned int width, unsigned int height, int start, int end) {
-    if (end == -1) {
-        end = bytes.size();
+// BT.601 conversion of one RGB pixel to Y, Cb and Cr
+static inline double rgbToY(double r, double g, double b) {
+    return 16 + (65.738 * r + 129.057 * g + 25.064 * b) / 256;
+}
+static inline double rgbToCb(double r, double g, double b) {
+    return 128 - (37.945 * r + 74.494 * g - 112.439 * b) / 256;
+}
+static inline double rgbToCr(double r, double g, double b) {
+    return 128 + (112.439 * r - 94.154 * g - 18.285 * b) / 256;
+}
+
+// Saturate a reconstructed channel value to a byte, so lossy samples
+// outside [0, 255] don't wrap around
+static inline unsigned char clampToByte(double value) {
+    return value < 0 ? 0 : (value > 255 ? 255 : (unsigned char) value);
+}
+
+template <typename T>
+std::shared_ptr<T> allocateAligned(size_t count) {
+    void* buffer = NULL;
+    if (posix_memalign(&buffer, IMAGE_ALIGNMENT, count * sizeof(T)) != 0) {
+        fprintf(stderr, "Failed to allocate %zu bytes!\n", count * sizeof(T));
+        exit(1);
+    }
+    return std::shared_ptr<T>(static_cast<T*>(buffer), free);
+}
+
+template <typename T>
+Plane<T> allocatePlane(int width, int height) {
+    Plane<T> plane;
+    int elems_per_line = IMAGE_ALIGNMENT / sizeof(T);
+    plane.width = width;
+    plane.height = height;
+    plane.stride = (width + elems_per_line - 1) / elems_per_line * elems_per_line;
+    plane.data = allocateAligned<T>((size_t) plane.stride * height);
+    return plane;
+}
+
+const char* chromaSubsamplingName(ChromaSubsampling subsampling) {
+    switch (subsampling) {
+        case CHROMA_444: return "4:4:4";
+        case CHROMA_422: return "4:2:2";
+        default: return "4:2:0";
+    }
+}
+
+bool parseChromaSubsampling(const std::string& name, ChromaSubsampling& subsampling) {
+    static const char* names[NUM_CHROMA_SUBSAMPLINGS] = {"444", "422", "420"};
+    for (int i = 0; i < NUM_CHROMA_SUBSAMPLINGS; i++) {
+        if (name == names[i]) {
+            subsampling = (ChromaSubsampling) i;
+            return true;
+        }
     }
+    return false;
+}
+
+template <>
+const char* sampleTypeName<double>() { return "double"; }
+template <>
+const char* sampleTypeName<float>() { return "float"; }
+template <>
+const char* sampleTypeName<int16_t>() { return "int16"; }
+
+std::shared_ptr<ImageRgb> allocateImageRgb(int width, int height) {
     std::shared_ptr<ImageRgb> image(new ImageRgb());
-    image->numPixels = (end - start + 1) / 4;
-    std::vector<std::shared_ptr<PixelRgba>> pixels(image->numPixels);
     image->width = width;
     image->height = height;
-    #pragma omp parallel for
-    for (int i = start; i < end; i += 4) {
-        std::shared_ptr<PixelRgba> pixel(new PixelRgba());
-        pixel->r = bytes[i];
-        pixel->g = bytes[i + 1];
-        pixel->b = bytes[i + 2];
-        pixel->a = bytes[i + 3];
-        pixels[(i - start) / 4] = pixel;
-    }
-    image->pixels = pixels;
+    image->numPixels = width * height;
+    image->r = allocatePlane<unsigned char>(width, height);
+    image->g = allocatePlane<unsigned char>(width, height);
+    image->b = allocatePlane<unsigned char>(width, height);
+    return image;
+}
+
+template <typename T>
+std::shared_ptr<ImageYcbcr<T>> allocateImageYcbcr(int width, int height, int components, ChromaSubsampling subsampling) {
+    std::shared_ptr<ImageYcbcr<T>> image(new ImageYcbcr<T>());
+    image->width = width;
+    image->height = height;
+    image->numPixels = width * height;
+    image->numComponents = components;
+    image->subsampling = subsampling;
+    image->y = allocatePlane<T>(width, height);
+    if (components > 1) {
+        int fx = chromaFactorX(subsampling);
+        int fy = chromaFactorY(subsampling);
+        image->cb = allocatePlane<T>((width + fx - 1) / fx, (height + fy - 1) / fy);
+        image->cr = allocatePlane<T>((width + fx - 1) / fx, (height + fy - 1) / fy);
+    }
+    return image;
+}
+
+template <typename T>
+BlockPlane<T> allocateBlockPlane(int blocksWidth, int blocksHeight) {
+    BlockPlane<T> plane;
+    plane.blocksWidth = blocksWidth;
+    plane.blocksHeight = blocksHeight;
+    plane.numBlocks = blocksWidth * blocksHeight;
+    plane.data = allocateAligned<T>((size_t) plane.numBlocks * MACROBLOCK_PIXELS);
+    plane.extent.assign(plane.numBlocks, MACROBLOCK_SIZE);
+    return plane;
+}
+
+McuGrid mcuGrid(int width, int height, int block_size, ChromaSubsampling subsampling) {
+    McuGrid grid;
+    grid.mcuWidth = chromaFactorX(subsampling);
+    grid.mcuHeight = chromaFactorY(subsampling);
+    int mcu_pixels_x = grid.mcuWidth * block_size;
+    int mcu_pixels_y = grid.mcuHeight * block_size;
+    grid.mcusWidth = (width + mcu_pixels_x - 1) / mcu_pixels_x;
+    grid.mcusHeight = (height + mcu_pixels_y - 1) / mcu_pixels_y;
+    grid.numMcus = grid.mcusWidth * grid.mcusHeight;
+    return grid;
+}
+
+template <typename T>
+std::shared_ptr<ImageBlocks<T>> allocateImageBlocks(int width, int height, int block_size, int components,
+                                                    ChromaSubsampling subsampling, int first_mcu, int num_mcus) {
+    if (block_size != MACROBLOCK_SIZE) {
+        fprintf(stderr, "Block store only supports %dx%d blocks!\n", MACROBLOCK_SIZE, MACROBLOCK_SIZE);
+        exit(1);
+    }
+    std::shared_ptr<ImageBlocks<T>> image(new ImageBlocks<T>());
+    if (components == 1) {
+        subsampling = CHROMA_444;
+    }
+    image->width = width;
+    image->height = height;
+    image->numComponents = components;
+    image->subsampling = subsampling;
+    image->grid = mcuGrid(width, height, block_size, subsampling);
+    image->firstMcu = first_mcu;
+    const McuGrid& grid = image->grid;
+    if (num_mcus == -1) {
+        // the whole image, each plane in its own block grid
+        image->numMcus = grid.numMcus;
+        image->y = allocateBlockPlane<T>(grid.mcusWidth * grid.mcuWidth, grid.mcusHeight * grid.mcuHeight);
+    } else {
+        // a run of MCUs is stored as a single row of blocks
+        image->numMcus = num_mcus;
+        image->y = allocateBlockPlane<T>(num_mcus * grid.lumaBlocksPerMcu(), 1);
+    }
+    if (components > 1) {
+        // one block of each chroma component per MCU
+        int blocks_width = num_mcus == -1 ? grid.mcusWidth : num_mcus;
+        int blocks_height = num_mcus == -1 ? grid.mcusHeight : 1;
+        image->cb = allocateBlockPlane<T>(blocks_width, blocks_height);
+        image->cr = allocateBlockPlane<T>(blocks_width, blocks_height);
+    }
     return image;
 }
 
 std::vector<unsigned char> convertImageToBytes(std::shared_ptr<ImageRgb> image) {
-    std::vector<unsigned char> bytes;
-    for (auto pixel : image->pixels) {
-        bytes.push_back(pixel->r);
-        bytes.push_back(pixel->g);
-        bytes.push_back(pixel->b);
-        // ignore reconstructed alpha
-        bytes.push_back(DEFAULT_ALPHA);
+    std::vector<unsigned char> bytes((size_t) image->width * image->height * 4);
+    #pragma omp parallel for
+    for (int i = 0; i < image->height; i++) {
+        unsigned char* dst = &bytes[(size_t) i * image->width * 4];
+        const unsigned char* r = image->r.row(i);
+        const unsigned char* g = image->g.row(i);
+        const unsigned char* b = image->b.row(i);
+        for (int j = 0; j < image->width; j++) {
+            dst[4 * j] = r[j];
+            dst[4 * j + 1] = g[j];
+            dst[4 * j + 2] = b[j];
+            // ignore reconstructed alpha
+            dst[4 * j + 3] = DEFAULT_ALPHA;
+        }
     }
     return bytes;
 }
 
-std::shared_ptr<ImageYcbcr> convertRgbToYcbcr(std::shared_ptr<ImageRgb> input) {
-    std::shared_ptr<ImageYcbcr> result(new ImageYcbcr());
-    result->numPixels = input->numPixels;
-    result->width = input->width;
-    result->height = input->height;
-    std::vector<std::shared_ptr<PixelYcbcr>> new_pixels(input->pixels.size());
-    #pragma omp parallel for
-    for (unsigned int i = 0; i < input->pixels.size(); i++) {
-        auto pixel = input->pixels[i];
-        std::shared_ptr<PixelYcbcr> new_pixel(new PixelYcbcr());
-        new_pixel->y = 16 + (65.738 * pixel->r + 129.057 * pixel->g + 25.064 * pixel->b) / 256;
-        new_pixel->cb = 128 - (37.945 * pixel->r + 74.494 * pixel->g - 112.439 * pixel->b) / 256;
-        new_pixel->cr = 128 + (112.439 * pixel->r - 94.154 * pixel->g - 18.285 * pixel->b) / 256;
-        new_pixels[i] = new_pixel;
-    }
-    result->pixels = new_pixels;
-    return result;
+unsigned int decodePng(PixelImage& image, const char* filename) {
+    std::vector<unsigned char> png;
+    unsigned int error = lodepng::load_file(png, filename);
+    if (error) {
+        return error;
+    }
+    lodepng::State state;
+    error = lodepng_inspect(&image.width, &image.height, &state, png.data(), png.size());
+    if (error) {
+        return error;
+    }
+
+    // ask lodepng for the layout the PNG already has, at 8 bits per sample
+    LodePNGColorType colortype = state.info_png.color.colortype;
+    if (colortype == LCT_PALETTE && state.info_png.color.bitdepth == 8) {
+        // keep the stored palette indices
+        state.decoder.color_convert = 0;
+        image.layout = PIXEL_PALETTE;
+    } else if (colortype == LCT_GREY || colortype == LCT_GREY_ALPHA) {
+        state.info_raw.colortype = LCT_GREY;
+        state.info_raw.bitdepth = 8;
+        image.layout = PIXEL_GREY;
+    } else {
+        state.info_raw.colortype = LCT_RGB;
+        state.info_raw.bitdepth = 8;
+        image.layout = PIXEL_RGB;
+    }
+    error = lodepng::decode(image.bytes, image.width, image.height, state, png);
+    if (error) {
+        return error;
+    }
+
+    // palette and grey pixels are looked up in a table of RGBA entries
+    image.palette.assign(256 * 4, 0);
+    if (image.layout == PIXEL_PALETTE) {
+        const LodePNGColorMode& color = state.info_png.color;
+        std::copy(color.palette, color.palette + color.palettesize * 4, image.palette.begin());
+    } else if (image.layout == PIXEL_GREY) {
+        for (int v = 0; v < 256; v++) {
+            image.palette[4 * v] = image.palette[4 * v + 1] = image.palette[4 * v + 2] = v;
+            image.palette[4 * v + 3] = DEFAULT_ALPHA;
+        }
+    }
+    return 0;
 }
 
-std::shared_ptr<ImageRgb> convertYcbcrToRgb(std::shared_ptr<ImageYcbcr> input) {
-    std::shared_ptr<ImageRgb> result(new ImageRgb());
-    result->numPixels = input->numPixels;
-    result->width = input->width;
-    result->height = input->height;
-    std::vector<std::shared_ptr<PixelRgba>> new_pixels;
-    for (auto pixel : input->pixels) {
-        std::shared_ptr<PixelRgba> new_pixel(new PixelRgba());
-        new_pixel->r = (298.082 * pixel->y + 408.583 * pixel->cr) / 256 - 222.921;
-        new_pixel->g = (298.082 * pixel->y - 100.291 * pixel->cb - 208.120 * pixel->cr) / 256 + 135.576;
-        new_pixel->b = (298.082 * pixel->y + 516.412 * pixel->cb) / 256 - 276.836;
-        new_pixels.push_back(new_pixel);
-    }
-    result->pixels = new_pixels;
-    return result;
+static inline bool isGreyPixel(const unsigned char* px) {
+    return px[0] == px[1] && px[1] == px[2];
 }
 
-std::shared_ptr<ImageBlocks> convertYcbcrToBlocks(std::shared_ptr<ImageYcbcr> input, int block_size) {
-    std::shared_ptr<ImageBlocks> result(new ImageBlocks());
-    std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> blocks;
-    result->width = input->width;
-    result->height = input->height;
-    int blocks_width = (input->width + block_size - 1) / block_size;
-    int blocks_height = (input->height + block_size - 1) / block_size;
-    result->numBlocks = blocks_width * blocks_height;
-    int offset = 0;
-    // rows of blocks
-    for (int i = 0; i < blocks_height; i++) {
-        int start_index = i * block_size * block_size * blocks_width;
-        // blocks in next row of image
-        std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> block_row(blocks_width, std::vector<std::shared_ptr<PixelYcbcr>>(block_size * block_size));
-        // rows of pixels in the row of blocks
-        for (int j = 0; j < block_size; j++) {
-            int row_index = start_index + j * block_size * blocks_width;
-            // pixels in the row of pixels
-            #pragma omp parallel for
-            for (int k = 0; k < block_size * blocks_width; k++) {
-                int pixel_index = row_index + k - offset;
-                std::shared_ptr<PixelYcbcr> pixel(new PixelYcbcr());
-                if (pixel_in_bounds(i * block_size + j, k, input->width, input->height)) {
-                    pixel->y = input->pixels[pixel_index]->y;
-                    pixel->cb = input->pixels[pixel_index]->cb;
-                    pixel->cr = input->pixels[pixel_index]->cr;
-                } else {
-                    pixel->y = 0;
-                    pixel->cb = 0;
-                    pixel->cr = 0;
-                    offset++;
-                }
-                block_row[k / block_size][sub2ind(block_size, k % block_size, j)] = pixel;
+bool isGrayscale(const PixelImage& image) {
+    if (image.layout == PIXEL_GREY) {
+        return true;
+    }
+    if (image.layout == PIXEL_PALETTE) {
+        // only the entries the pixels use have to be grey
+        bool used[256] = {false};
+        for (unsigned char index : image.bytes) {
+            used[index] = true;
+        }
+        for (int v = 0; v < 256; v++) {
+            if (used[v] && !isGreyPixel(&image.palette[4 * v])) {
+                return false;
             }
         }
-        blocks.insert(blocks.end(), block_row.begin(), block_row.end());
+        return true;
     }
-    result->blocks = blocks;
-    if (result->width % block_size != 0) {
-        result->width += block_size - (result->width % block_size);
+    // most colour images give themselves away within a few pixels, so the
+    // scan runs in order and stops at the first coloured one
+    for (size_t i = 0; i < image.bytes.size(); i += 3) {
+        if (!isGreyPixel(&image.bytes[i])) {
+            return false;
+        }
     }
-    if (result->height % block_size != 0) {
-        result->height += block_size - (result->height % block_size);
+    return true;
+}
+
+// Pixel readers for convertPixelsToBlocks. Both return the address of the
+// R, G and B bytes of pixel (row, col).
+struct RgbPixels {
+    const unsigned char* bytes;
+    unsigned int width;
+
+    const unsigned char* operator()(int row, int col) const {
+        return bytes + ((size_t) row * width + col) * 3;
     }
-    downsampleCbcr(result, block_size);
-    return result;
+};
+
+struct IndexedPixels {
+    const unsigned char* bytes;
+    unsigned int width;
+    const unsigned char* palette;
+
+    const unsigned char* operator()(int row, int col) const {
+        return palette + 4 * bytes[(size_t) row * width + col];
+    }
+};
+
+// True if every sample of the <block_size> square <block> is the same
+template <typename T>
+static bool isUniformBlock(const T* block, int block_size) {
+    for (int i = 1; i < block_size * block_size; i++) {
+        if (block[i] != block[0]) {
+            return false;
+        }
+    }
+    return true;
 }
 
-std::shared_ptr<ImageYcbcr> convertBlocksToYcbcr(std::shared_ptr<ImageBlocks> input, int block_size) {
-    upsampleCbcr(input, block_size);
-    std::shared_ptr<ImageYcbcr> result(new ImageYcbcr());
-    std::vector<std::shared_ptr<PixelYcbcr>> pixels;
-    result->numPixels = input->width * input->height;
-    result->width = input->width;
-    result->height = input->height;
-    int blocks_width = (input->width + block_size - 1) / block_size;
-    int blocks_height = (input->height + block_size - 1) / block_size;
-    for (int i = 0; i < blocks_height; i++) {
-        // pixels in every row
-        std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> pixel_rows(block_size);
-        for (int j = 0; j < blocks_width; j++) {
-            auto block = input->blocks[sub2ind(blocks_width, j, i)];
-            for (unsigned int k = 0; k < block.size(); k++) {
-                Coord block_coord = ind2sub(block_size, k);
-                if (pixel_in_bounds(i * block_size + block_coord.row, j * block_size + block_coord.col, input->width, input->height)) {
-                    std::shared_ptr<PixelYcbcr> pixel(new PixelYcbcr());
-                    pixel->y = block[k]->y;
-                    pixel->cb = block[k]->cb;
-                    pixel->cr = block[k]->cr;
-                    pixel_rows[block_coord.row].push_back(pixel);
+template <typename T, typename Pixels>
+static void convertPixelsToBlocks(Pixels pixels, unsigned int width, unsigned int height, int block_size, ImageBlocks<T>& result) {
+    const McuGrid& grid = result.grid;
+    int luma_blocks = grid.lumaBlocksPerMcu();
+    // an MCU is as many luma blocks across and down as share a chroma sample
+    int fx = grid.mcuWidth;
+    int fy = grid.mcuHeight;
+    #pragma omp parallel for
+    for (int m = 0; m < result.numMcus; m++) {
+        int mcu_row = (result.firstMcu + m) / grid.mcusWidth;
+        int mcu_col = (result.firstMcu + m) % grid.mcusWidth;
+        for (int k = 0; k < luma_blocks; k++) {
+            T* y = result.y.block(m * luma_blocks + k);
+            int top = (mcu_row * fy + k / fx) * block_size;
+            int left = (mcu_col * fx + k % fx) * block_size;
+            for (int r = 0; r < block_size; r++) {
+                // pad past the bottom and right edges by repeating the last pixel
+                int row = std::min(top + r, (int) height - 1);
+                for (int c = 0; c < block_size; c++) {
+                    int col = std::min(left + c, (int) width - 1);
+                    const unsigned char* px = pixels(row, col);
+                    y[r * block_size + c] = fromDouble<T>(rgbToY(px[0], px[1], px[2]));
                 }
             }
+            result.y.extent[m * luma_blocks + k] = isUniformBlock(y, block_size) ? 1 : block_size;
+        }
+        if (result.numComponents == 1) {
+            continue;
         }
-        // add all pixel_rows to image
-        for (int j = 0; j < block_size; j++) {
-            pixels.insert(pixels.end(), pixel_rows[j].begin(), pixel_rows[j].end());
+        // each chroma sample is the mean of the fx x fy pixels it covers;
+        // the conversion is linear, so the pixels are averaged first
+        T* cb = result.cb.block(m);
+        T* cr = result.cr.block(m);
+        int top = mcu_row * fy * block_size;
+        int left = mcu_col * fx * block_size;
+        for (int r = 0; r < block_size; r++) {
+            for (int c = 0; c < block_size; c++) {
+                double sum[3] = {0, 0, 0};
+                for (int i = 0; i < fy; i++) {
+                    int row = std::min(top + r * fy + i, (int) height - 1);
+                    for (int j = 0; j < fx; j++) {
+                        int col = std::min(left + c * fx + j, (int) width - 1);
+                        const unsigned char* px = pixels(row, col);
+                        sum[0] += px[0];
+                        sum[1] += px[1];
+                        sum[2] += px[2];
+                    }
+                }
+                double n = fx * fy;
+                cb[r * block_size + c] = fromDouble<T>(rgbToCb(sum[0] / n, sum[1] / n, sum[2] / n));
+                cr[r * block_size + c] = fromDouble<T>(rgbToCr(sum[0] / n, sum[1] / n, sum[2] / n));
+            }
         }
+        result.cb.extent[m] = isUniformBlock(cb, block_size) ? 1 : block_size;
+        result.cr.extent[m] = isUniformBlock(cr, block_size) ? 1 : block_size;
+    }
+}
+
+template <typename T>
+std::shared_ptr<ImageBlocks<T>> convertBytesToBlocks(const PixelImage& image, int block_size, int first_mcu, int num_mcus,
+                                                     int components, ChromaSubsampling subsampling) {
+    std::shared_ptr<ImageBlocks<T>> result = allocateImageBlocks<T>(image.width, image.height, block_size, components,
+                                                                    subsampling, first_mcu, num_mcus);
+    if (image.layout == PIXEL_RGB) {
+        RgbPixels pixels = {image.bytes.data(), image.width};
+        convertPixelsToBlocks(pixels, image.width, image.height, block_size, *result);
+    } else {
+        IndexedPixels pixels = {image.bytes.data(), image.width, image.palette.data()};
+        convertPixelsToBlocks(pixels, image.width, image.height, block_size, *result);
     }
-    result->pixels = pixels;
     return result;
 }
 
-void downsampleCbcr(std::shared_ptr<ImageBlocks> image, int block_size) {
-    #pragma omp parallel for
-    for (unsigned int i = 0; i < image->blocks.size(); i++) {
-        auto block = image->blocks[i];
-        for (unsigned int j = 0; j < block.size(); j++) {
-            Coord coord = ind2sub(block_size, j);
-            if ((coord.row < block_size / 2) && (coord.col < block_size / 2)) {
-                Coord sample_coord;
-                sample_coord.col = coord.col * 2;
-                sample_coord.row = coord.row * 2;
-                int sample_index = sub2ind(block_size, sample_coord);
-                block[j]->cb = block[sample_index]->cb;
-                block[j]->cr = block[sample_index]->cr;
-            } else {
-                block[j]->cb = 0;
-                block[j]->cr = 0;
+int bandMcus(const PixelImage& image, int block_size, int band_rows, size_t sample_size, size_t budget,
+             int components, ChromaSubsampling subsampling) {
+    McuGrid grid = mcuGrid(image.width, image.height, block_size, components == 1 ? CHROMA_444 : subsampling);
+    if (budget == 0) {
+        int rows = std::min(grid.mcusHeight, std::max(1, band_rows / (grid.mcuHeight * block_size)));
+        return rows * grid.mcusWidth;
+    }
+    // a quarter of what the input leaves goes to the band's blocks, the
+    // rest is headroom for the encoded blocks and for decoding
+    size_t input_bytes = image.bytes.size() + image.palette.size();
+    size_t band_bytes = budget > input_bytes ? (budget - input_bytes) / 4 : 0;
+    int blocks_per_mcu = grid.lumaBlocksPerMcu() + components - 1;
+    size_t row_bytes = (size_t) grid.mcusWidth * blocks_per_mcu * block_size * block_size * sample_size;
+    int rows = std::min((size_t) grid.mcusHeight, std::max((size_t) 1, band_bytes / row_bytes));
+    return rows * grid.mcusWidth;
+}
+
+template <typename T>
+std::shared_ptr<ImageRgb> convertYcbcrToRgb(std::shared_ptr<ImageYcbcr<T>> input) {
+    std::shared_ptr<ImageRgb> result = allocateImageRgb(input->width, input->height);
+    if (input->numComponents == 1) {
+        #pragma omp parallel for
+        for (int i = 0; i < input->height; i++) {
+            const T* y = input->y.row(i);
+            unsigned char* r = result->r.row(i);
+            unsigned char* g = result->g.row(i);
+            unsigned char* b = result->b.row(i);
+            for (int j = 0; j < input->width; j++) {
+                // R, G and B of neutral (128) chroma all come to this
+                r[j] = g[j] = b[j] = clampToByte((298.082 * y[j] + 408.583 * 128) / 256 - 222.921);
             }
         }
+        return result;
+    }
+    // every pixel needs its own chroma
+    upsampleCbcr(input);
+    #pragma omp parallel for
+    for (int i = 0; i < input->height; i++) {
+        const T* y = input->y.row(i);
+        const T* cb = input->cb.row(i);
+        const T* cr = input->cr.row(i);
+        unsigned char* r = result->r.row(i);
+        unsigned char* g = result->g.row(i);
+        unsigned char* b = result->b.row(i);
+        for (int j = 0; j < input->width; j++) {
+            r[j] = clampToByte((298.082 * y[j] + 408.583 * cr[j]) / 256 - 222.921);
+            g[j] = clampToByte((298.082 * y[j] - 100.291 * cb[j] - 208.120 * cr[j]) / 256 + 135.576);
+            b[j] = clampToByte((298.082 * y[j] + 516.412 * cb[j]) / 256 - 276.836);
+        }
+    }
+    return result;
+}
+
+// Copy a <size> x <size> block to (top, left) of <plane>, dropping the
+// pixels that fall past its edges
+template <typename T>
+static void copyBlockToPlane(const T* block, int size, int top, int left, Plane<T>& plane) {
+    for (int r = 0; r < size && top + r < plane.height; r++) {
+        T* dst = plane.row(top + r);
+        for (int c = 0; c < size && left + c < plane.width; c++) {
+            dst[left + c] = block[r * size + c];
+        }
+    }
+}
+
+template <typename T>
+std::shared_ptr<ImageYcbcr<T>> convertBlocksToYcbcr(std::shared_ptr<ImageBlocks<T>> input, int block_size, int scale) {
+    // each block holds its pixels at the output scale
+    int size = block_size / scale;
+    int width = (input->width + scale - 1) / scale;
+    int height = (input->height + scale - 1) / scale;
+    std::shared_ptr<ImageYcbcr<T>> result = allocateImageYcbcr<T>(width, height, input->numComponents, input->subsampling);
+    const McuGrid& grid = input->grid;
+    int luma_blocks = grid.lumaBlocksPerMcu();
+    #pragma omp parallel for
+    for (int m = 0; m < input->numMcus; m++) {
+        int mcu_row = (input->firstMcu + m) / grid.mcusWidth;
+        int mcu_col = (input->firstMcu + m) % grid.mcusWidth;
+        for (int k = 0; k < luma_blocks; k++) {
+            copyBlockToPlane(input->y.block(m * luma_blocks + k), size, (mcu_row * grid.mcuHeight + k / grid.mcuWidth) * size,
+                (mcu_col * grid.mcuWidth + k % grid.mcuWidth) * size, result->y);
+        }
+        if (input->numComponents > 1) {
+            copyBlockToPlane(input->cr.block(m), size, mcu_row * size, mcu_col * size, result->cr);
+            copyBlockToPlane(input->cb.block(m), size, mcu_row * size, mcu_col * size, result->cb);
+        }
+    }
+    return result;
+}
+
+// Linear interpolation of a chroma plane subsampled by fx x fy up to
+// <width> x <height>. Output pixel i along a subsampled axis sits a
+// quarter of a sample from sample i / 2, towards its neighbour on the
+// side i is on, so takes 3/4 of the one and 1/4 of the other.
+template <typename T>
+static Plane<T> interpolateUp(const Plane<T>& plane, int fx, int fy, int width, int height) {
+    Plane<T> result = allocatePlane<T>(width, height);
+    #pragma omp parallel for
+    for (int r = 0; r < height; r++) {
+        int r0 = r / fy;
+        int r1 = fy == 1 ? r0 : std::max(0, std::min(plane.height - 1, r % 2 == 0 ? r0 - 1 : r0 + 1));
+        double w1 = fy == 1 ? 0 : 0.25;
+        const T* near_row = plane.row(r0);
+        const T* far_row = plane.row(r1);
+        std::vector<double> column_mix(plane.width);
+        for (int c = 0; c < plane.width; c++) {
+            column_mix[c] = (1 - w1) * near_row[c] + w1 * far_row[c];
+        }
+        T* dst = result.row(r);
+        for (int c = 0; c < width; c++) {
+            int c0 = c / fx;
+            int c1 = fx == 1 ? c0 : std::max(0, std::min(plane.width - 1, c % 2 == 0 ? c0 - 1 : c0 + 1));
+            double v1 = fx == 1 ? 0 : 0.25;
+            dst[c] = fromDouble<T>((1 - v1) * column_mix[c0] + v1 * column_mix[c1]);
+        }
     }
+    return result;
 }
 
-void upsampleCbcr(std::shared_ptr<ImageBlocks> image, int block_size) {
-    for (auto block : image->blocks) {
-        // restore cb/cr to original locations
-        for (unsigned int i = block.size() - 1; i > 0; i--) {
-            Coord coord = ind2sub(block_size, i);
-            Coord sample_coord;
-            sample_coord.row = coord.row / 2;
-            sample_coord.col = coord.col / 2;
-            int sample_index = sub2ind(block_size, sample_coord);
-            block[i]->cb = block[sample_index]->cb;
-            block[i]->cr = block[sample_index]->cr;
-        }
-        // interpolate lost cb/cr by averaging 2 nearby pixels
-        for (int i = 1; i < block_size - 1; i += 2) {
-            for (int j = 1; j < block_size - 1; j += 2) {
-                int lower_index = sub2ind(block_size, j-1, i-1);
-                int index = sub2ind(block_size, j, i);
-                int upper_index = sub2ind(block_size, j+1, i+1);
-                double cb = (block[lower_index]->cb + block[upper_index]->cb) / 2;
-                double cr = (block[lower_index]->cr + block[upper_index]->cr) / 2;
-                block[index]->cb = cb;
-                block[index]->cr = cr;
+template <typename T>
+void upsampleCbcr(std::shared_ptr<ImageYcbcr<T>> image) {
+    if (image->numComponents == 1 || image->subsampling == CHROMA_444) {
+        return;
+    }
+    int fx = chromaFactorX(image->subsampling);
+    int fy = chromaFactorY(image->subsampling);
+    image->cb = interpolateUp(image->cb, fx, fy, image->width, image->height);
+    image->cr = interpolateUp(image->cr, fx, fy, image->width, image->height);
+    image->subsampling = CHROMA_444;
+}
+
+double computePsnr(const PixelImage& original, Span<const unsigned char> recovered) {
+    RgbPixels rgb = {original.bytes.data(), original.width};
+    IndexedPixels indexed = {original.bytes.data(), original.width, original.palette.data()};
+    double squared_error = 0;
+    #pragma omp parallel for reduction(+:squared_error)
+    for (int row = 0; row < (int) original.height; row++) {
+        for (unsigned int col = 0; col < original.width; col++) {
+            const unsigned char* px = original.layout == PIXEL_RGB ? rgb(row, col) : indexed(row, col);
+            // skip alpha
+            const unsigned char* out = &recovered[((size_t) row * original.width + col) * 4];
+            for (int c = 0; c < 3; c++) {
+                double diff = (double) px[c] - out[c];
+                squared_error += diff * diff;
             }
         }
     }
+    double mse = squared_error / ((double) original.width * original.height * 3);
+    if (mse == 0) {
+        return INFINITY;
+    }
+    return 10 * log10(255.0 * 255.0 / mse);
 }
 
+#define INSTANTIATE_IMAGE(T) \
+    template std::shared_ptr<T> allocateAligned<T>(size_t count); \
+    template Plane<T> allocatePlane<T>(int width, int height); \
+    template std::shared_ptr<ImageYcbcr<T>> allocateImageYcbcr<T>(int width, int height, int components, ChromaSubsampling subsampling); \
+    template BlockPlane<T> allocateBlockPlane<T>(int blocksWidth, int blocksHeight); \
+    template std::shared_ptr<ImageBlocks<T>> allocateImageBlocks<T>(int width, int height, int block_size, int components, \
+        ChromaSubsampling subsampling, int first_mcu, int num_mcus); \
+    template std::shared_ptr<ImageBlocks<T>> convertBytesToBlocks<T>(const PixelImage& image, int block_size, int first_mcu, int num_mcus, \
+        int components, ChromaSubsampling subsampling); \
+    template std::shared_ptr<ImageRgb> convertYcbcrToRgb<T>(std::shared_ptr<ImageYcbcr<T>> input); \
+    template std::shared_ptr<ImageYcbcr<T>> convertBlocksToYcbcr<T>(std::shared_ptr<ImageBlocks<T>> input, int block_size, int scale); \
+    template void upsampleCbcr<T>(std::shared_ptr<ImageYcbcr<T>> image);
+
+FOR_EACH_SAMPLE_TYPE(INSTANTIATE_IMAGE)
+template std::shared_ptr<unsigned char> allocateAligned<unsigned char>(size_t count);
+template Plane<unsigned char> allocatePlane<unsigned char>(int width, int height);
+
 // image utils
 
 // check if a pixel is in bounds
@@ -1,54 +1,313 @@
 #include <vector>
 #include <memory>
+#include <string>
+#include <stdint.h>
+#include <math.h>
 
 #ifndef IMAGE_H
 #define IMAGE_H
 
-struct PixelRgba {
-    unsigned char r;
-    unsigned char g;
-    unsigned char b;
-    unsigned char a;
+// Byte alignment of every plane buffer and of every plane row
+#define IMAGE_ALIGNMENT 64
+
+// Side of the blocks images are split into, fixed at build time
+// (make BLOCK_SIZE=N) to one of the sizes the transform is instantiated
+// for, so every per-block loop has a constant trip count
+#ifndef MACROBLOCK_SIZE
+#define MACROBLOCK_SIZE 8
+#endif
+#define MACROBLOCK_PIXELS (MACROBLOCK_SIZE * MACROBLOCK_SIZE)
+
+static_assert(MACROBLOCK_SIZE == 4 || MACROBLOCK_SIZE == 8 || MACROBLOCK_SIZE == 16,
+    "MACROBLOCK_SIZE must be 4, 8 or 16");
+
+#define COLOR_Y  0
+#define COLOR_CR 1
+#define COLOR_CB 2
+
+// Components of a colour image; grayscale images carry Y alone
+#define NUM_COMPONENTS 3
+
+// Resolution chroma is stored at, relative to luma
+enum ChromaSubsampling {
+    CHROMA_444, // full resolution
+    CHROMA_422, // half across
+    CHROMA_420, // half across and down
+    NUM_CHROMA_SUBSAMPLINGS
+};
+
+const char* chromaSubsamplingName(ChromaSubsampling subsampling);
+// Subsampling called <name> (444, 422 or 420); returns false if there is none
+bool parseChromaSubsampling(const std::string& name, ChromaSubsampling& subsampling);
+
+// Luma pixels across and down that share one chroma sample
+inline int chromaFactorX(ChromaSubsampling subsampling) { return subsampling == CHROMA_444 ? 1 : 2; }
+inline int chromaFactorY(ChromaSubsampling subsampling) { return subsampling == CHROMA_420 ? 2 : 1; }
+
+// Sample/coefficient types the YCbCr pipeline is instantiated for:
+// double, float and integer (fixed-point transform) int16_t.
+#define FOR_EACH_SAMPLE_TYPE(X) X(double) X(float) X(int16_t)
+
+// Store a computed value as sample type T, rounding to nearest for
+// integer types
+template <typename T>
+inline T fromDouble(double value) { return static_cast<T>(value); }
+template <>
+inline int16_t fromDouble<int16_t>(double value) { return static_cast<int16_t>(lrint(value)); }
+
+// A quantized coefficient as DPCM, the run-length stage and the
+// compressed file hold it, whatever the sample type: quantization leaves
+// every coefficient an integer, and even at step 1 the DC differences of
+// 8-bit samples fit 16 bits
+typedef int16_t Coefficient;
+
+// Quantized coefficient <value> of sample type T as a Coefficient; the
+// quantizer rounded it, so the conversion is exact
+template <typename T>
+inline Coefficient toCoefficient(T value) { return static_cast<Coefficient>(value); }
+
+// Printable name of sample type T
+template <typename T>
+const char* sampleTypeName();
+
+// Allocate <count> elements of T in one buffer aligned to IMAGE_ALIGNMENT.
+// The buffer is released when the last shared_ptr to it goes away.
+template <typename T>
+std::shared_ptr<T> allocateAligned(size_t count);
+
+// Non-owning view of <size> contiguous elements. Span<const T> views
+// input that a stage only reads; Span<T> converts to it implicitly.
+template <typename T>
+class Span {
+public:
+    Span() : ptr(NULL), len(0) {}
+    Span(T* ptr, size_t len) : ptr(ptr), len(len) {}
+    template <typename U>
+    Span(const Span<U>& other) : ptr(other.data()), len(other.size()) {}
+    template <typename U>
+    Span(std::vector<U>& v) : ptr(v.data()), len(v.size()) {}
+    template <typename U>
+    Span(const std::vector<U>& v) : ptr(v.data()), len(v.size()) {}
+
+    T* data() const { return ptr; }
+    size_t size() const { return len; }
+    T& operator[](size_t i) const { return ptr[i]; }
+    T* begin() const { return ptr; }
+    T* end() const { return ptr + len; }
+
+private:
+    T* ptr;
+    size_t len;
 };
 
-struct PixelYcbcr {
-    double y;
-    double cb;
-    double cr;
+// One channel of an image, stored row-major in a single contiguous buffer.
+// Rows are padded to <stride> elements so every row starts aligned.
+template <typename T>
+struct Plane {
+    std::shared_ptr<T> data;
+    int width;
+    int height;
+    int stride;
+
+    T* row(int r) { return data.get() + (size_t) r * stride; }
+    const T* row(int r) const { return data.get() + (size_t) r * stride; }
 };
 
+template <typename T>
+Plane<T> allocatePlane(int width, int height);
+
+// Planar RGB image, one plane per channel. Alpha is dropped on input
+// and restored as opaque on output.
 struct ImageRgb {
-    std::vector<std::shared_ptr<PixelRgba>> pixels;
+    Plane<unsigned char> r;
+    Plane<unsigned char> g;
+    Plane<unsigned char> b;
     int numPixels;
     int width;
     int height;
 };
 
+// Planar YCbCr image, one plane per component. The chroma planes are
+// <subsampling>'s fraction of the luma plane's size, rounded up.
+// Grayscale images (numComponents 1) leave them unallocated.
+template <typename T>
 struct ImageYcbcr {
-    std::vector<std::shared_ptr<PixelYcbcr>> pixels;
+    Plane<T> y;
+    Plane<T> cb;
+    Plane<T> cr;
+    int numComponents;
+    ChromaSubsampling subsampling;
     int numPixels;
     int width;
     int height;
 };
 
-struct ImageBlocks {
-    std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> blocks;
+// Blocks of one component in a single aligned allocation. Block <idx>
+// is a fixed array of MACROBLOCK_PIXELS coefficients starting at
+// block(idx), stored row-major within the block.
+template <typename T>
+struct BlockPlane {
+    std::shared_ptr<T> data;
     int numBlocks;
+    int blocksWidth;
+    int blocksHeight;
+    // Per block, the side of the top-left corner of its coefficients that
+    // holds every nonzero one, MACROBLOCK_SIZE if unknown. 1 is a block
+    // that is its DC value alone: all its samples are equal before the
+    // DCT, and all its coefficients but DC are zero after. The encoder
+    // marks uniform blocks as it converts them, the decoder records each
+    // block's extent as it decodes it, and the transforms skip or narrow
+    // to match.
+    std::vector<unsigned char> extent;
+
+    T* block(int idx) { return data.get() + (size_t) idx * MACROBLOCK_PIXELS; }
+    const T* block(int idx) const { return data.get() + (size_t) idx * MACROBLOCK_PIXELS; }
+    // The <count> blocks from <first> on, one after another
+    Span<T> blocks(int first, int count = 1) { return Span<T>(block(first), (size_t) count * MACROBLOCK_PIXELS); }
+    Span<const T> blocks(int first, int count = 1) const { return Span<const T>(block(first), (size_t) count * MACROBLOCK_PIXELS); }
+};
+
+template <typename T>
+BlockPlane<T> allocateBlockPlane(int blocksWidth, int blocksHeight);
+
+// Grid of MCUs (minimum coded units) covering an image. An MCU is the
+// mcuWidth x mcuHeight luma blocks that share one block of each chroma
+// component: one luma block at 4:4:4, 2x1 at 4:2:2 and 2x2 at 4:2:0.
+// Images are padded to whole MCUs.
+struct McuGrid {
+    int mcuWidth;
+    int mcuHeight;
+    int mcusWidth;
+    int mcusHeight;
+    int numMcus;
+
+    int lumaBlocksPerMcu() const { return mcuWidth * mcuHeight; }
+};
+
+McuGrid mcuGrid(int width, int height, int block_size, ChromaSubsampling subsampling);
+
+// Macroblocks of a run of MCUs of an image, one block plane per component.
+// Every plane holds its blocks in coding order: MCU by MCU and, within an
+// MCU, luma blocks row by row. Blocks are coded, and written out, MCU by
+// MCU as its luma blocks, then Cr, then Cb.
+// <width> and <height> are the image's size before padding to whole MCUs.
+// Grayscale images (numComponents 1) have no chroma block planes.
+template <typename T>
+struct ImageBlocks {
+    BlockPlane<T> y;
+    BlockPlane<T> cb;
+    BlockPlane<T> cr;
+    int numComponents;
+    ChromaSubsampling subsampling;
+    McuGrid grid;
+    // MCUs [firstMcu, firstMcu + numMcus) of the image are held
+    int firstMcu;
+    int numMcus;
     int width;
     int height;
+
+    BlockPlane<T>& component(int chan) { return chan == COLOR_Y ? y : (chan == COLOR_CR ? cr : cb); }
+    const BlockPlane<T>& component(int chan) const { return chan == COLOR_Y ? y : (chan == COLOR_CR ? cr : cb); }
+
+    int blocksPerMcu() const { return grid.lumaBlocksPerMcu() + numComponents - 1; }
+    int numCodedBlocks() const { return numMcus * blocksPerMcu(); }
+    // Component of block <idx> in coding order
+    int codedComponent(int idx) const {
+        int k = idx % blocksPerMcu() - grid.lumaBlocksPerMcu();
+        return k < 0 ? COLOR_Y : (k == 0 ? COLOR_CR : COLOR_CB);
+    }
+    // Index of block <idx> in coding order within its component's plane
+    int codedPlaneIndex(int idx) const {
+        int mcu = idx / blocksPerMcu();
+        int k = idx % blocksPerMcu();
+        int luma = grid.lumaBlocksPerMcu();
+        return k < luma ? mcu * luma + k : mcu;
+    }
+    // Block <idx> in coding order
+    Span<T> codedBlock(int idx) {
+        return component(codedComponent(idx)).blocks(codedPlaneIndex(idx));
+    }
+    unsigned char& codedExtent(int idx) {
+        return component(codedComponent(idx)).extent[codedPlaneIndex(idx)];
+    }
+};
+
+// Layout of decoded PNG pixels, 8 bits per sample
+enum PixelLayout {
+    PIXEL_RGB,      // 3 bytes per pixel
+    PIXEL_GREY,     // 1 byte per pixel
+    PIXEL_PALETTE   // 1 palette index per pixel
 };
 
-std::shared_ptr<ImageRgb> convertBytesToImage(std::vector<unsigned char> bytes, unsigned int width, unsigned int height, int start = 0, int end = -1);
+// A PNG decoded in its own colour type rather than expanded to RGBA.
+// Grey and palette images carry a 256 entry RGBA <palette> to look
+// their pixels up in; alpha is dropped.
+struct PixelImage {
+    std::vector<unsigned char> bytes;
+    std::vector<unsigned char> palette;
+    unsigned int width;
+    unsigned int height;
+    PixelLayout layout;
+};
+
+// Decode the PNG in <filename> into <image>; returns the lodepng error
+unsigned int decodePng(PixelImage& image, const char* filename);
+
+// True if every pixel of <image> is grey: a grey PNG, or palette entries
+// or RGB pixels with R == G == B throughout
+bool isGrayscale(const PixelImage& image);
+
+std::shared_ptr<ImageRgb> allocateImageRgb(int width, int height);
+// <components> is NUM_COMPONENTS, or 1 for a grayscale image
+template <typename T>
+std::shared_ptr<ImageYcbcr<T>> allocateImageYcbcr(int width, int height, int components = NUM_COMPONENTS,
+                                                   ChromaSubsampling subsampling = CHROMA_444);
+// Blocks of every MCU of a <width> x <height> image, or with <num_mcus>
+// set, of MCUs [first_mcu, first_mcu + num_mcus). Grayscale images are
+// always coded one block per MCU.
+template <typename T>
+std::shared_ptr<ImageBlocks<T>> allocateImageBlocks(int width, int height, int block_size, int components = NUM_COMPONENTS,
+                                                    ChromaSubsampling subsampling = CHROMA_444, int first_mcu = 0, int num_mcus = -1);
+
 std::vector<unsigned char> convertImageToBytes(std::shared_ptr<ImageRgb> image);
 
-std::shared_ptr<ImageYcbcr> convertRgbToYcbcr(std::shared_ptr<ImageRgb> input);
-std::shared_ptr<ImageRgb> convertYcbcrToRgb(std::shared_ptr<ImageYcbcr> input);
+// A grayscale image converts to R = G = B, as if its chroma were neutral
+template <typename T>
+std::shared_ptr<ImageRgb> convertYcbcrToRgb(std::shared_ptr<ImageYcbcr<T>> input);
+
+// Convert a decoded PNG straight into YCbCr macroblocks in one pass,
+// box filtering chroma down to <subsampling> and padding partial edge
+// MCUs with the nearest edge pixel. Converts MCUs [first_mcu, first_mcu +
+// num_mcus) of the image; num_mcus = -1 means all of them. With
+// <components> 1 only luma is converted.
+template <typename T>
+std::shared_ptr<ImageBlocks<T>> convertBytesToBlocks(const PixelImage& image, int block_size, int first_mcu = 0, int num_mcus = -1,
+                                                     int components = NUM_COMPONENTS, ChromaSubsampling subsampling = CHROMA_444);
+
+// Number of MCUs, in whole MCU rows, to convert and encode at a time.
+// Without a memory budget a band covers <band_rows> pixel rows (at least
+// one MCU row); with one, a band of blocks with <sample_size> byte
+// samples, <components> components and <subsampling> chroma is as tall as
+// fits in what <budget> bytes leave after the decoded input.
+int bandMcus(const PixelImage& image, int block_size, int band_rows, size_t sample_size, size_t budget,
+             int components = NUM_COMPONENTS, ChromaSubsampling subsampling = CHROMA_444);
+
+// Assemble decoded blocks into a planar image, chroma left subsampled.
+// At 1/<scale> of the encoded size, each block holds block_size / scale
+// pixels square row-major at its start, and the image is the encoded
+// one's size divided by <scale>, rounded up.
+template <typename T>
+std::shared_ptr<ImageYcbcr<T>> convertBlocksToYcbcr(std::shared_ptr<ImageBlocks<T>> input, int block_size, int scale = 1);
 
-std::shared_ptr<ImageBlocks> convertYcbcrToBlocks(std::shared_ptr<ImageYcbcr> input, int block_size);
-std::shared_ptr<ImageYcbcr> convertBlocksToYcbcr(std::shared_ptr<ImageBlocks> input, int block_size);
+// Bring subsampled chroma back to full resolution, interpolating
+// linearly between neighbouring samples (across block edges too), each
+// sample taken to sit at the centre of the pixels it covers
+template <typename T>
+void upsampleCbcr(std::shared_ptr<ImageYcbcr<T>> image);
 
-void downsampleCbcr(std::shared_ptr<ImageBlocks> image, int block_size);
-void upsampleCbcr(std::shared_ptr<ImageBlocks> image, int block_size);
+// Peak signal-to-noise ratio in dB of <recovered> RGBA bytes against
+// <original>, over the R, G and B channels
+double computePsnr(const PixelImage& original, Span<const unsigned char> recovered);
 
 // image utils
 
@@ -0,0 +1,50 @@
+#include "stdio.h"
+#include "string.h"
+#include "CycleTimer.h"
+#include "meminfo.h"
+
+// Read a "<field>: <n> kB" line of /proc/self/status
+static size_t readStatusKb(const char* field) {
+    FILE* status = fopen("/proc/self/status", "r");
+    if (status == NULL) {
+        return 0;
+    }
+    size_t field_len = strlen(field);
+    size_t kb = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), status) != NULL) {
+        if (strncmp(line, field, field_len) == 0 && line[field_len] == ':') {
+            sscanf(line + field_len + 1, "%zu", &kb);
+            break;
+        }
+    }
+    fclose(status);
+    return kb * 1024;
+}
+
+size_t peakResidentBytes() {
+    return readStatusKb("VmHWM");
+}
+
+bool resetPeakResident() {
+    // "5" resets the peak RSS to the current RSS (Linux 4.0+)
+    FILE* clear_refs = fopen("/proc/self/clear_refs", "w");
+    if (clear_refs == NULL) {
+        return false;
+    }
+    bool ok = fputs("5", clear_refs) >= 0;
+    return fclose(clear_refs) == 0 && ok;
+}
+
+void StageStats::start() {
+    resetPeakResident();
+    startTime = CycleTimer::currentSeconds();
+}
+
+void StageStats::stop() {
+    seconds += CycleTimer::currentSeconds() - startTime;
+    size_t peak = peakResidentBytes();
+    if (peak > peakBytes) {
+        peakBytes = peak;
+    }
+}
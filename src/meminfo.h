@@ -0,0 +1,33 @@
+#include <cstddef>
+
+#ifndef MEMINFO_H
+#define MEMINFO_H
+
+#define BYTES_PER_MB (1024.0 * 1024.0)
+
+// Peak resident set size since the last resetPeakResident(), in bytes.
+// Without a reset this is the peak over the life of the process.
+size_t peakResidentBytes();
+
+// Restart peak tracking from the current resident size, so the next
+// peakResidentBytes() covers only what runs in between.
+// Returns false if the kernel doesn't support resetting the peak.
+bool resetPeakResident();
+
+// Wall time and peak resident memory of one pipeline stage, summed
+// (time) and maxed (memory) over every band the stage runs on
+struct StageStats {
+    double seconds;
+    size_t peakBytes;
+
+    StageStats() : seconds(0), peakBytes(0), startTime(0) {}
+
+    void start();
+    void stop();
+    double peakMb() const { return peakBytes / BYTES_PER_MB; }
+
+private:
+    double startTime;
+};
+
+#endif
@@ -2,6 +2,8 @@
 #include <fstream>
 #include <cstdarg>
 #include <string>
+#include <algorithm>
+#include <functional>
 #include "CycleTimer.h"
 #include "getopt.h"
 #include "stdio.h"
@@ -10,9 +12,11 @@
 #include "quantize.h"
 #include "dpcm.h"
 #include "rle.h"
+#include "ratecontrol.h"
+#include "meminfo.h"
+#include "options.h"
 #include <omp.h>
 
-#define MACROBLOCK_SIZE 8
 
 #ifndef LOGLEVEL
 #define LOGLEVEL 0 // set to 1 for log output
@@ -30,18 +34,26 @@ void log(int rank, const char* format, ...) {
     va_end(args);
 }
 
-std::shared_ptr<JpegEncoded> jpegSeq(const char* infile, const char* outfile, const char* compressedFile) {
-    fprintf(stdout, "running sequential version\n");
+template <typename T>
+void jpegSeq(const char* infile, const char* outfile, const char* compressedFile, const EncodeOptions& options) {
+    fprintf(stdout, "running sequential version (%s)\n", sampleTypeName<T>());
 
     double startTime = CycleTimer::currentSeconds();
 
-    std::vector<unsigned char> bytes; // The raw pixels
+    PixelImage pixels; // The raw pixels, in the PNG's own layout
     unsigned int width, height;
+    StageStats loadImageStats, convertStats, rateStats, dctStats, dpcmStats, rleStats, writeStats;
 
     // Decode
-    double loadImageStartTime = CycleTimer::currentSeconds();
-    unsigned int error = lodepng::decode(bytes, width, height, infile);
-    double loadImageStopTime = CycleTimer::currentSeconds();
+    loadImageStats.start();
+    unsigned int error = decodePng(pixels, infile);
+    // grayscale input is encoded as luma alone, with no chroma at any stage
+    int components = isGrayscale(pixels) ? 1 : NUM_COMPONENTS;
+    bool all = components == NUM_COMPONENTS;
+    ChromaSubsampling subsampling = all ? options.chromaSubsampling : CHROMA_444;
+    loadImageStats.stop();
+    width = pixels.width;
+    height = pixels.height;
 
     // If there's an error, display it
     if(error) {
@@ -50,140 +62,238 @@ std::shared_ptr<JpegEncoded> jpegSeq(const char* infile, const char* outfile, co
       log(0, "success decoding %s!\n", infile);
     }
 
-    // 4 bytes per pixel, ordered RGBARGBA
-    log(0, "convertBytesToImage()...\n");
-    double convertBytesToImageStartTime = CycleTimer::currentSeconds();
-    std::shared_ptr<ImageRgb> imageRgb = convertBytesToImage(bytes, width, height);
-    double convertBytesToImageEndTime = CycleTimer::currentSeconds();
-
-    log(0, "convertRgbToYcbcr()...\n");
-    double convertRgbToYcbcrStartTime = CycleTimer::currentSeconds();
-    std::shared_ptr<ImageYcbcr> imageYcbcr = convertRgbToYcbcr(imageRgb);
-    double convertRgbToYcbcrEndTime = CycleTimer::currentSeconds();
-
-    log(0, "convertYcbcrToBlocks()...\n");
-    double convertYcbcrToBlocksStartTime = CycleTimer::currentSeconds();
-    std::shared_ptr<ImageBlocks> imageBlocks = convertYcbcrToBlocks(imageYcbcr, MACROBLOCK_SIZE);
-    double convertYcbcrToBlocksEndTime = CycleTimer::currentSeconds();
-
-    log(0, "DCT()...\n");
-    double dctStartTime = CycleTimer::currentSeconds();
-    std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> dcts;
-    for (auto block : imageBlocks->blocks) {
-        dcts.push_back(DCT(block, MACROBLOCK_SIZE, true));
+    // The image is streamed in bands of whole MCU rows: each band is
+    // converted, encoded and appended to the compressed file before the next
+    // one is read, so only one band's blocks are held at a time.
+    int numMcus = mcuGrid(width, height, MACROBLOCK_SIZE, subsampling).numMcus;
+    int mcusPerBand = bandMcus(pixels, MACROBLOCK_SIZE, options.bandRows, sizeof(T), options.memBudget, components, subsampling);
+    // With a target size, the image is transformed once and the quality
+    // is the highest whose estimated size fits it; only that quality is
+    // encoded. Within a memory budget the whole image's coefficients
+    // don't fit, so each estimate transforms it again band by band.
+    int quality = options.quality;
+    size_t estimatedBytes = 0;
+    if (options.targetBytes) {
+        log(0, "rate control...\n");
+        rateStats.start();
+        std::shared_ptr<ImageBlocks<T>> coefficients;
+        if (!options.memBudget) {
+            coefficients = rateControlBlocks<T>(pixels, 0, numMcus, components, subsampling, options.dctKernel);
+        }
+        std::function<size_t(int)> estimate = [&](int q) {
+            size_t bytes = coefficients ? estimateEncodedBytes(*coefficients, q, options.dctKernel)
+                : estimateBandedBytes<T>(pixels, 0, numMcus, mcusPerBand, components, subsampling, q, options.dctKernel);
+            return headerBytes(components) + bytes;
+        };
+        quality = searchQuality(options.targetBytes, estimate);
+        estimatedBytes = estimate(quality);
+        rateStats.stop();
     }
-    double dctEndTime = CycleTimer::currentSeconds();
+    ArenaPool arenas;
+    // most bytes the arenas held at once, for the RLE report
+    size_t arenaBytes = 0;
+    std::vector<EncodedBlockColor*> encodedBlocks;
+    std::ofstream jpegFile(compressedFile, std::ios::binary);
+    // the tables are scaled to the quality once, and carried in the file
+    // for the decoder
+    QuantMatrix matrices[NUM_QUANT_TABLES] = {scaledQuantMatrix(QUANT_LUMA, quality),
+                                              scaledQuantMatrix(QUANT_CHROMA, quality)};
+    QuantTable<MACROBLOCK_SIZE> quantTables[NUM_QUANT_TABLES] = {matrices[QUANT_LUMA], matrices[QUANT_CHROMA]};
+    writeHeader(jpegFile, width, height, components, subsampling, matrices);
+    double firstOutputTime = 0;
+    Coefficient prevDc[3] = {0, 0, 0};
+    // blocks that skipped the DCT, being uniform, out of all coded blocks
+    int uniformBlocks = 0;
+    int numBlocks = 0;
+    for (int firstMcu = 0; firstMcu < numMcus; firstMcu += mcusPerBand) {
+        int numBandMcus = std::min(mcusPerBand, numMcus - firstMcu);
+
+        // pixels go straight into padded, subsampled YCbCr blocks
+        log(0, "convertBytesToBlocks()...\n");
+        convertStats.start();
+        std::shared_ptr<ImageBlocks<T>> imageBlocks = convertBytesToBlocks<T>(pixels, MACROBLOCK_SIZE, firstMcu, numBandMcus, components, subsampling);
+        convertStats.stop();
+        numBlocks += imageBlocks->numCodedBlocks();
+
+        // each block is quantized as it is transformed, in one pass, a run
+        // of blocks of a component at a time; uniform blocks skip the
+        // transform
+        log(0, "dctQuantize()...\n");
+        dctStats.start();
+        for (int chan = 0; chan < components; chan++) {
+            BlockPlane<T>& plane = imageBlocks->component(chan);
+            for (int i = 0; i < plane.numBlocks; i += DCT_RUN_BLOCKS) {
+                uniformBlocks += dctQuantizeBlocks<T, MACROBLOCK_SIZE>(plane, i,
+                    std::min(DCT_RUN_BLOCKS, plane.numBlocks - i), quantTables[quantTableOf(chan)],
+                    options.dctKernel, options.rdo);
+            }
+        }
+        dctStats.stop();
+
+        log(0, "DPCM()...\n");
+        dpcmStats.start();
+        DPCM(*imageBlocks, prevDc);
+        dpcmStats.stop();
+
+        log(0, "RLE()...\n");
+        rleStats.start();
+        encodedBlocks.clear();
+        for (int i = 0; i < imageBlocks->numCodedBlocks(); i++) {
+            encodedBlocks.push_back(RLE<T>(imageBlocks->codedBlock(i), MACROBLOCK_SIZE, arenas.local()));
+        }
+        rleStats.stop();
+        arenaBytes = std::max(arenaBytes, arenas.bytesAllocated());
 
-    log(0, "quantize()...\n");
-    double quantizeStartTime = CycleTimer::currentSeconds();
-    std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> quantizedBlocks;
-    for (auto dct : dcts) {
-        quantizedBlocks.push_back(quantize(dct, MACROBLOCK_SIZE, true));
-    }
-    double quantizeEndTime = CycleTimer::currentSeconds();
-
-    log(0, "DPCM()...\n");
-    double dpcmStartTime = CycleTimer::currentSeconds();
-    DPCM(quantizedBlocks);
-    double dpcmEndTime = CycleTimer::currentSeconds();
-
-    log(0, "RLE()...\n");
-    double rleStartTime = CycleTimer::currentSeconds();
-    std::vector<std::shared_ptr<EncodedBlock>> encodedBlocks;
-    for (auto quantizedBlock : quantizedBlocks) {
-        encodedBlocks.push_back(RLE(quantizedBlock, MACROBLOCK_SIZE));
+        log(0, "writing band to file...\n");
+        writeStats.start();
+        for (const auto &block : encodedBlocks) {
+            writeEncodedBlock(jpegFile, *block);
+        }
+        jpegFile.flush();
+        writeStats.stop();
+        if (firstMcu == 0) {
+            firstOutputTime = CycleTimer::currentSeconds() - startTime;
+        }
+        // the band is on disk, so its encoded blocks can go
+        arenas.release();
     }
-    double rleEndTime = CycleTimer::currentSeconds();
+    // every band is encoded, so the input can go
+    pixels = PixelImage();
 
+    size_t compressedBytes = jpegFile.tellp();
+    jpegFile.close();
     log(0, "done encoding!\n");
-    log(0, "writing to file...\n");
-    double writeCompressedImageStartTime = CycleTimer::currentSeconds();
-    std::ofstream jpegFile(compressedFile);
-    for (const auto &block : encodedBlocks) {
-        jpegFile << block;
-    }
-    double writeCompressedImageEndTime = CycleTimer::currentSeconds();
     log(0, "jpeg stored!\n");
 
-    std::shared_ptr<JpegEncoded> result = std::make_shared<JpegEncoded>();
-    result->encodedBlocks = encodedBlocks;
-    result->width = width;
-    result->height = height;
-
     double endTime = CycleTimer::currentSeconds();
+    size_t peakBytes = std::max({loadImageStats.peakBytes, convertStats.peakBytes, rateStats.peakBytes, dctStats.peakBytes,
+        dpcmStats.peakBytes, rleStats.peakBytes, writeStats.peakBytes});
 
     fprintf(stdout,
     "=======================================\n"
-    "= Sequential encoding performance: \n"
+    "= Sequential encoding performance (%s, %s DCT): \n"
     "=======================================\n"
-    "Load Image: %.3fs\n"
-    "Convert Bytes to Image: %.3fs\n"
-    "Convert RGB to YCbCr: %.3fs\n"
-    "Convert YCbCr to Blocks: %.3fs\n"
-    "DCT: %.3fs\n"
-    "Quantize: %.3fs\n"
-    "DPCM: %.3fs\n"
-    "RLE: %.3fs\n"
-    "Encode Compressed Image: %.3fs\n"
-    "Total time: %.3fs\n",
-    loadImageStopTime - loadImageStartTime,
-    convertBytesToImageEndTime - convertBytesToImageStartTime,
-    convertRgbToYcbcrEndTime - convertRgbToYcbcrStartTime,
-    convertYcbcrToBlocksEndTime - convertYcbcrToBlocksStartTime,
-    dctEndTime - dctStartTime,
-    quantizeEndTime - quantizeStartTime,
-    dpcmEndTime - dpcmStartTime,
-    rleEndTime - rleStartTime,
-    writeCompressedImageEndTime - writeCompressedImageStartTime,
-    endTime - startTime);
-
-    return result;
+    "Load Image: %.3fs, peak %.1f MB\n"
+    "Components: %s%s\n"
+    "Quality: %d%s\n"
+    "Convert Bytes to Blocks: %.3fs, peak %.1f MB\n"
+    "DCT + Quantize: %.3fs, peak %.1f MB, DCT error vs reference %.1e\n"
+    "Uniform blocks (DC only): %d of %d\n"
+    "DPCM: %.3fs, peak %.1f MB\n"
+    "RLE: %.3fs, peak %.1f MB, arenas %.1f MB\n"
+    "Encode Compressed Image: %.3fs, peak %.1f MB\n"
+    "Total time: %.3fs\n"
+    "First output: %.3fs\n"
+    "Peak memory: %.1f MB\n"
+    "Bands: %d of %d MCUs\n"
+    "Compressed size: %zu bytes\n",
+    sampleTypeName<T>(), dctImplementationName(options.dctKernel),
+    loadImageStats.seconds, loadImageStats.peakMb(),
+    all ? "YCbCr " : "Y (grayscale)", all ? chromaSubsamplingName(subsampling) : "",
+    quality, options.rdo ? ", RD-optimized quantization" : "",
+    convertStats.seconds, convertStats.peakMb(),
+    dctStats.seconds, dctStats.peakMb(), dctReferenceError<MACROBLOCK_SIZE>(options.dctKernel, DCT_CHECK_BLOCKS),
+    uniformBlocks, numBlocks,
+    dpcmStats.seconds, dpcmStats.peakMb(),
+    rleStats.seconds, rleStats.peakMb(), arenaBytes / BYTES_PER_MB,
+    writeStats.seconds, writeStats.peakMb(),
+    endTime - startTime,
+    firstOutputTime,
+    peakBytes / BYTES_PER_MB,
+    (numMcus + mcusPerBand - 1) / mcusPerBand, mcusPerBand,
+    compressedBytes);
+    if (options.targetBytes) {
+        fprintf(stdout, "Rate control: %.3fs, peak %.1f MB, quality %d estimated at %zu bytes for a target of %zu\n",
+            rateStats.seconds, rateStats.peakMb(), quality, estimatedBytes, options.targetBytes);
+    }
+    if (options.memBudget && peakBytes > options.memBudget) {
+        fprintf(stderr, "warning: peak memory %.1f MB is over the %.1f MB budget\n",
+            peakBytes / BYTES_PER_MB, options.memBudget / BYTES_PER_MB);
+    }
 }
 
-std::vector<unsigned char> jpegDecodeSeq(std::shared_ptr<JpegEncoded> jpegEncoded, const char* outfile) {
+template <typename T>
+std::vector<unsigned char> jpegDecodeSeq(const char* compressedFile, const char* outfile, DctKernel kernel, int scale) {
+
+    unsigned int width, height;
+    int components;
+    ChromaSubsampling subsampling;
+    std::ifstream jpegFile(compressedFile, std::ios::binary);
+    QuantMatrix matrices[NUM_QUANT_TABLES];
+    if (!readHeader(jpegFile, width, height, components, subsampling, matrices)) {
+        std::cout << "could not read " << compressedFile << std::endl;
+        return std::vector<unsigned char>();
+    }
 
-    unsigned int width = jpegEncoded->width;
-    unsigned int height = jpegEncoded->height;
-    std::vector<std::shared_ptr<EncodedBlock>> encodedBlocks = jpegEncoded->encodedBlocks;
+    // each intermediate is released as soon as the next stage has consumed it
 
     log(0, "==============\n");
     log(0, "now let's undo the process...\n");
 
     log(0, "undoing RLE()...\n");
-    std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> decodedQuantizedBlocks;
-    for (auto encodedBlock : encodedBlocks) {
-        decodedQuantizedBlocks.push_back(decodeRLE(encodedBlock, MACROBLOCK_SIZE));
+    // blocks are read back one at a time into the same encoded block
+    Arena arena;
+    EncodedBlockColor* encodedBlock = arena.create<EncodedBlockColor>(&arena);
+    std::shared_ptr<ImageBlocks<T>> decodedBlocks = allocateImageBlocks<T>(width, height, MACROBLOCK_SIZE, components, subsampling);
+    for (int i = 0; i < decodedBlocks->numCodedBlocks(); i++) {
+        if (!readEncodedBlock(jpegFile, *encodedBlock)) {
+            std::cout << compressedFile << " is truncated at block " << i << std::endl;
+            return std::vector<unsigned char>();
+        }
+        decodedBlocks->codedExtent(i) = decodeRLE<T>(*encodedBlock, decodedBlocks->codedBlock(i), MACROBLOCK_SIZE);
+        if (decodedBlocks->codedExtent(i) == 0) {
+            std::cout << compressedFile << " is corrupt at block " << i << std::endl;
+            return std::vector<unsigned char>();
+        }
     }
 
     log(0, "undoing DPCM()...\n");
-    unDPCM(decodedQuantizedBlocks);
+    unDPCM(*decodedBlocks);
+
+    // a reduced size decode runs the scaled matrix IDCT on orthonormal
+    // coefficients, whatever kernel encoded them
+    DctKernel idctKernel = scale > 1 ? DCT_MATRIX : kernel;
 
     log(0, "undoing quantize()...\n");
-    std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> unquantizedBlocks;
-    for (auto decodedQuantizedBlock : decodedQuantizedBlocks) {
-        unquantizedBlocks.push_back(unquantize(decodedQuantizedBlock, MACROBLOCK_SIZE, true));
+    // by the tables the encoder quantized with
+    QuantTable<MACROBLOCK_SIZE> quantTables[NUM_QUANT_TABLES] = {matrices[QUANT_LUMA], matrices[QUANT_CHROMA]};
+    for (int chan = 0; chan < components; chan++) {
+        BlockPlane<T>& plane = decodedBlocks->component(chan);
+        Span<T> blocks = plane.blocks(0, plane.numBlocks);
+        unquantize<T, MACROBLOCK_SIZE>(blocks, blocks, quantTables[quantTableOf(chan)], idctKernel);
     }
 
     log(0, "undoing DCT()...\n");
-    std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> idcts;
-    for (auto unquantized : unquantizedBlocks) {
-        idcts.push_back(IDCT(unquantized, MACROBLOCK_SIZE, true));
+    double idctStartTime = CycleTimer::currentSeconds();
+    // every plane has its own block grid, so at a reduced size chroma
+    // scales down with luma
+    // each block takes the narrowest transform its coefficients allow
+    int shapes[NUM_IDCT_SHAPES] = {0};
+    for (int chan = 0; chan < components; chan++) {
+        BlockPlane<T>& plane = decodedBlocks->component(chan);
+        for (int i = 0; i < plane.numBlocks; i += DCT_RUN_BLOCKS) {
+            idctBlocks<T, MACROBLOCK_SIZE>(plane, i, std::min(DCT_RUN_BLOCKS, plane.numBlocks - i),
+                idctKernel, scale, shapes);
+        }
     }
+    fprintf(stdout, "IDCT (%s, 1/%d scale): %.3fs, blocks %s %d, %s %d, %s %d, %s %d\n",
+        dctImplementationName(idctKernel), scale, CycleTimer::currentSeconds() - idctStartTime,
+        idctShapeName(IDCT_DC_ONLY), shapes[IDCT_DC_ONLY], idctShapeName(IDCT_2X2), shapes[IDCT_2X2],
+        idctShapeName(IDCT_4X4), shapes[IDCT_4X4], idctShapeName(IDCT_FULL), shapes[IDCT_FULL]);
 
-    log(0, "undoing convertYcbcrToBlocks()...\n");
-    std::shared_ptr<ImageBlocks> imageBlocksIdct(new ImageBlocks);
-    imageBlocksIdct->blocks = idcts;
-    imageBlocksIdct->width = width;
-    imageBlocksIdct->height = height;
-    std::shared_ptr<ImageYcbcr> imgFromBlocks = convertBlocksToYcbcr(imageBlocksIdct, MACROBLOCK_SIZE);
+    log(0, "convertBlocksToYcbcr()...\n");
+    std::shared_ptr<ImageYcbcr<T>> imgFromBlocks = convertBlocksToYcbcr(decodedBlocks, MACROBLOCK_SIZE, scale);
+    decodedBlocks.reset();
 
-    log(0, "undoing convertRgbToYcbcr()...\n");
+    log(0, "convertYcbcrToRgb()...\n");
     std::shared_ptr<ImageRgb> imageRgbRecovered = convertYcbcrToRgb(imgFromBlocks);
+    imgFromBlocks.reset();
 
-    log(0, "undoing convertBytesToImage()...\n");
+    log(0, "convertImageToBytes()...\n");
     std::vector<unsigned char> imgRecovered = convertImageToBytes(imageRgbRecovered);
+    imageRgbRecovered.reset();
 
-    unsigned int error = lodepng::encode(outfile, imgRecovered, width, height);
+    unsigned int error = lodepng::encode(outfile, imgRecovered, (width + scale - 1) / scale, (height + scale - 1) / scale);
 
     if(error) {
         std::cout << "encoder error " << error << ": "<< lodepng_error_text(error) << std::endl;
@@ -194,145 +304,316 @@ std::vector<unsigned char> jpegDecodeSeq(std::shared_ptr<JpegEncoded> jpegEncode
     return imgRecovered;
 }
 
-void encodeSeq(const char* infile, const char* outfile, const char* compressedFile) {
+// Report the quality of <imgRecovered> against the image in <infile>,
+// if it was decoded at full size
+void reportPsnr(const char* infile, const std::vector<unsigned char>& imgRecovered) {
+    PixelImage pixels;
+    if (imgRecovered.empty() || decodePng(pixels, infile)
+        || imgRecovered.size() != (size_t) pixels.width * pixels.height * 4) {
+        return;
+    }
+    fprintf(stdout, "PSNR: %.3f dB\n", computePsnr(pixels, imgRecovered));
+}
+
+template <typename T>
+void encodeSeq(const char* infile, const char* outfile, const char* compressedFile, const EncodeOptions& options) {
 
-    std::shared_ptr<JpegEncoded> jpegEncoded = jpegSeq(infile, outfile, compressedFile);
-    std::vector<std::shared_ptr<EncodedBlock>> encodedBlocks = jpegEncoded->encodedBlocks;
-    std::vector<unsigned char> imgRecovered = jpegDecodeSeq(jpegEncoded, outfile);
+    jpegSeq<T>(infile, outfile, compressedFile, options);
+    std::vector<unsigned char> imgRecovered = jpegDecodeSeq<T>(compressedFile, outfile, options.dctKernel, options.decodeScale);
+    reportPsnr(infile, imgRecovered);
 
 }
 
-std::shared_ptr<JpegEncoded> jpegPar(const char* infile, const char* outfile, const char* compressedFile) {
-
-    fprintf(stdout, "running OMP version\n");
+template <typename T>
+void jpegPar(const char* infile, const char* outfile, const char* compressedFile, const EncodeOptions& options) {
+    fprintf(stdout, "running OMP version (%s)\n", sampleTypeName<T>());
 
     double startTime = CycleTimer::currentSeconds();
 
-    std::vector<unsigned char> bytes;
+    PixelImage pixels; // The raw pixels, in the PNG's own layout
     unsigned int width, height;
+    StageStats loadImageStats, convertStats, rateStats, dctStats, dpcmStats, rleStats, writeStats;
 
-    double loadImageStartTime = CycleTimer::currentSeconds();
-    unsigned int error = lodepng::decode(bytes, width, height, infile);
-    double loadImageStopTime = CycleTimer::currentSeconds();
+    // Decode
+    loadImageStats.start();
+    unsigned int error = decodePng(pixels, infile);
+    // grayscale input is encoded as luma alone, with no chroma at any stage
+    int components = isGrayscale(pixels) ? 1 : NUM_COMPONENTS;
+    bool all = components == NUM_COMPONENTS;
+    ChromaSubsampling subsampling = all ? options.chromaSubsampling : CHROMA_444;
+    loadImageStats.stop();
+    width = pixels.width;
+    height = pixels.height;
 
+    // If there's an error, display it
     if(error) {
       std::cout << "decoder error " << error << ": " << lodepng_error_text(error) << std::endl;
     } else {
       log(0, "success decoding %s!\n", infile);
     }
 
-    log(0, "convertBytesToImage()...\n");
-    double convertBytesToImageStartTime = CycleTimer::currentSeconds();
-    std::shared_ptr<ImageRgb> imageRgb = convertBytesToImage(bytes, width, height);
-    double convertBytesToImageEndTime = CycleTimer::currentSeconds();
-
-    log(0, "convertRgbToYcbcr()...\n");
-    double convertRgbToYcbcrStartTime = CycleTimer::currentSeconds();
-    std::shared_ptr<ImageYcbcr> imageYcbcr = convertRgbToYcbcr(imageRgb);
-    double convertRgbToYcbcrEndTime = CycleTimer::currentSeconds();
-
-    log(0, "convertYcbcrToBlocks()...\n");
-    double convertYcbcrToBlocksStartTime = CycleTimer::currentSeconds();
-    std::shared_ptr<ImageBlocks> imageBlocks = convertYcbcrToBlocks(imageYcbcr, MACROBLOCK_SIZE);
-    double convertYcbcrToBlocksEndTime = CycleTimer::currentSeconds();
-
-    log(0, "DCT()...\n");
-    double dctStartTime = CycleTimer::currentSeconds();
-    std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> dcts(imageBlocks->blocks.size());
-    #pragma omp parallel for
-    for (unsigned int i = 0; i < imageBlocks->blocks.size(); i++) {
-        auto block = imageBlocks->blocks[i];
-        dcts[i] = DCT(block, MACROBLOCK_SIZE, true);
-    }
-    double dctEndTime = CycleTimer::currentSeconds();
-
-    log(0, "quantize()...\n");
-    double quantizeStartTime = CycleTimer::currentSeconds();
-    std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> quantizedBlocks(dcts.size());
-    #pragma omp parallel for
-    for (unsigned int i = 0; i < dcts.size(); i++) {
-        auto dct = dcts[i];
-        quantizedBlocks[i] = quantize(dct, MACROBLOCK_SIZE, true);
+    // The image is streamed in bands of whole MCU rows: each band is
+    // converted, encoded and appended to the compressed file before the next
+    // one is read, so only one band's blocks are held at a time.
+    int numMcus = mcuGrid(width, height, MACROBLOCK_SIZE, subsampling).numMcus;
+    int mcusPerBand = bandMcus(pixels, MACROBLOCK_SIZE, options.bandRows, sizeof(T), options.memBudget, components, subsampling);
+    // With a target size, the image is transformed once and the quality
+    // is the highest whose estimated size fits it; only that quality is
+    // encoded. Within a memory budget the whole image's coefficients
+    // don't fit, so each estimate transforms it again band by band.
+    int quality = options.quality;
+    size_t estimatedBytes = 0;
+    if (options.targetBytes) {
+        log(0, "rate control...\n");
+        rateStats.start();
+        std::shared_ptr<ImageBlocks<T>> coefficients;
+        if (!options.memBudget) {
+            coefficients = rateControlBlocks<T>(pixels, 0, numMcus, components, subsampling, options.dctKernel);
+        }
+        std::function<size_t(int)> estimate = [&](int q) {
+            size_t bytes = coefficients ? estimateEncodedBytes(*coefficients, q, options.dctKernel)
+                : estimateBandedBytes<T>(pixels, 0, numMcus, mcusPerBand, components, subsampling, q, options.dctKernel);
+            return headerBytes(components) + bytes;
+        };
+        quality = searchQuality(options.targetBytes, estimate);
+        estimatedBytes = estimate(quality);
+        rateStats.stop();
     }
-    double quantizeEndTime = CycleTimer::currentSeconds();
-
-    log(0, "DPCM()...\n");
-    double dpcmStartTime = CycleTimer::currentSeconds();
-    DPCM(quantizedBlocks);
-    double dpcmEndTime = CycleTimer::currentSeconds();
-
-    log(0, "RLE()...\n");
-    double rleStartTime = CycleTimer::currentSeconds();
-    std::vector<std::shared_ptr<EncodedBlock>> encodedBlocks(quantizedBlocks.size());
-    #pragma omp parallel for
-    for (unsigned int i = 0; i < quantizedBlocks.size(); i++) {
-        auto quantizedBlock = quantizedBlocks[i];
-        encodedBlocks[i] = RLE(quantizedBlock, MACROBLOCK_SIZE);
+    ArenaPool arenas;
+    // most bytes the arenas held at once, for the RLE report
+    size_t arenaBytes = 0;
+    std::vector<EncodedBlockColor*> encodedBlocks;
+    std::ofstream jpegFile(compressedFile, std::ios::binary);
+    // the tables are scaled to the quality once, and carried in the file
+    // for the decoder
+    QuantMatrix matrices[NUM_QUANT_TABLES] = {scaledQuantMatrix(QUANT_LUMA, quality),
+                                              scaledQuantMatrix(QUANT_CHROMA, quality)};
+    QuantTable<MACROBLOCK_SIZE> quantTables[NUM_QUANT_TABLES] = {matrices[QUANT_LUMA], matrices[QUANT_CHROMA]};
+    writeHeader(jpegFile, width, height, components, subsampling, matrices);
+    double firstOutputTime = 0;
+    Coefficient prevDc[3] = {0, 0, 0};
+    // blocks that skipped the DCT, being uniform, out of all coded blocks
+    int uniformBlocks = 0;
+    int numBlocks = 0;
+    for (int firstMcu = 0; firstMcu < numMcus; firstMcu += mcusPerBand) {
+        int numBandMcus = std::min(mcusPerBand, numMcus - firstMcu);
+
+        // pixels go straight into padded, subsampled YCbCr blocks
+        log(0, "convertBytesToBlocks()...\n");
+        convertStats.start();
+        std::shared_ptr<ImageBlocks<T>> imageBlocks = convertBytesToBlocks<T>(pixels, MACROBLOCK_SIZE, firstMcu, numBandMcus, components, subsampling);
+        convertStats.stop();
+        numBlocks += imageBlocks->numCodedBlocks();
+
+        // each block is quantized as it is transformed, in one pass, a run
+        // of blocks of a component at a time; uniform blocks skip the
+        // transform
+        log(0, "dctQuantize()...\n");
+        dctStats.start();
+        for (int chan = 0; chan < components; chan++) {
+            BlockPlane<T>& plane = imageBlocks->component(chan);
+            #pragma omp parallel for reduction(+:uniformBlocks)
+            for (int i = 0; i < plane.numBlocks; i += DCT_RUN_BLOCKS) {
+                uniformBlocks += dctQuantizeBlocks<T, MACROBLOCK_SIZE>(plane, i,
+                    std::min(DCT_RUN_BLOCKS, plane.numBlocks - i), quantTables[quantTableOf(chan)],
+                    options.dctKernel, options.rdo);
+            }
+        }
+        dctStats.stop();
+
+        log(0, "DPCM()...\n");
+        dpcmStats.start();
+        DPCM(*imageBlocks, prevDc);
+        dpcmStats.stop();
+
+        log(0, "RLE()...\n");
+        rleStats.start();
+        encodedBlocks.resize(imageBlocks->numCodedBlocks());
+        #pragma omp parallel for
+        for (int i = 0; i < imageBlocks->numCodedBlocks(); i++) {
+            encodedBlocks[i] = RLE<T>(imageBlocks->codedBlock(i), MACROBLOCK_SIZE, arenas.local());
+        }
+        rleStats.stop();
+        arenaBytes = std::max(arenaBytes, arenas.bytesAllocated());
+
+        // blocks are written in order, so the band is written by one thread
+        log(0, "writing band to file...\n");
+        writeStats.start();
+        for (const auto &block : encodedBlocks) {
+            writeEncodedBlock(jpegFile, *block);
+        }
+        jpegFile.flush();
+        writeStats.stop();
+        if (firstMcu == 0) {
+            firstOutputTime = CycleTimer::currentSeconds() - startTime;
+        }
+        // the band is on disk, so its encoded blocks can go
+        arenas.release();
     }
-    double rleEndTime = CycleTimer::currentSeconds();
+    // every band is encoded, so the input can go
+    pixels = PixelImage();
 
+    size_t compressedBytes = jpegFile.tellp();
+    jpegFile.close();
     log(0, "done encoding!\n");
-    log(0, "writing to file...\n");
-    double writeCompressedImageStartTime = CycleTimer::currentSeconds();
-    std::ofstream jpegFile(compressedFile);
-    for (const auto &block : encodedBlocks) {
-        jpegFile << block;
-    }
-    double writeCompressedImageEndTime = CycleTimer::currentSeconds();
     log(0, "jpeg stored!\n");
 
-    std::shared_ptr<JpegEncoded> result = std::make_shared<JpegEncoded>();
-    result->encodedBlocks = encodedBlocks;
-    result->width = width;
-    result->height = height;
-
     double endTime = CycleTimer::currentSeconds();
+    size_t peakBytes = std::max({loadImageStats.peakBytes, convertStats.peakBytes, rateStats.peakBytes, dctStats.peakBytes,
+        dpcmStats.peakBytes, rleStats.peakBytes, writeStats.peakBytes});
 
     fprintf(stdout,
     "=======================================\n"
-    "= OMP encoding performance: \n"
+    "= OMP encoding performance (%s, %s DCT): \n"
     "=======================================\n"
-    "Load Image: %.3fs\n"
-    "Convert Bytes to Image: %.3fs\n"
-    "Convert RGB to YCbCr: %.3fs\n"
-    "Convert YCbCr to Blocks: %.3fs\n"
-    "DCT: %.3fs\n"
-    "Quantize: %.3fs\n"
-    "DPCM: %.3fs\n"
-    "RLE: %.3fs\n"
-    "Encode Compressed Image: %.3fs\n"
-    "Total time: %.3fs\n",
-    loadImageStopTime - loadImageStartTime,
-    convertBytesToImageEndTime - convertBytesToImageStartTime,
-    convertRgbToYcbcrEndTime - convertRgbToYcbcrStartTime,
-    convertYcbcrToBlocksEndTime - convertYcbcrToBlocksStartTime,
-    dctEndTime - dctStartTime,
-    quantizeEndTime - quantizeStartTime,
-    dpcmEndTime - dpcmStartTime,
-    rleEndTime - rleStartTime,
-    writeCompressedImageEndTime - writeCompressedImageStartTime,
-    endTime - startTime);
-
-    return result;
+    "Load Image: %.3fs, peak %.1f MB\n"
+    "Components: %s%s\n"
+    "Quality: %d%s\n"
+    "Convert Bytes to Blocks: %.3fs, peak %.1f MB\n"
+    "DCT + Quantize: %.3fs, peak %.1f MB, DCT error vs reference %.1e\n"
+    "Uniform blocks (DC only): %d of %d\n"
+    "DPCM: %.3fs, peak %.1f MB\n"
+    "RLE: %.3fs, peak %.1f MB, arenas %.1f MB\n"
+    "Encode Compressed Image: %.3fs, peak %.1f MB\n"
+    "Total time: %.3fs\n"
+    "First output: %.3fs\n"
+    "Peak memory: %.1f MB\n"
+    "Bands: %d of %d MCUs\n"
+    "Compressed size: %zu bytes\n",
+    sampleTypeName<T>(), dctImplementationName(options.dctKernel),
+    loadImageStats.seconds, loadImageStats.peakMb(),
+    all ? "YCbCr " : "Y (grayscale)", all ? chromaSubsamplingName(subsampling) : "",
+    quality, options.rdo ? ", RD-optimized quantization" : "",
+    convertStats.seconds, convertStats.peakMb(),
+    dctStats.seconds, dctStats.peakMb(), dctReferenceError<MACROBLOCK_SIZE>(options.dctKernel, DCT_CHECK_BLOCKS),
+    uniformBlocks, numBlocks,
+    dpcmStats.seconds, dpcmStats.peakMb(),
+    rleStats.seconds, rleStats.peakMb(), arenaBytes / BYTES_PER_MB,
+    writeStats.seconds, writeStats.peakMb(),
+    endTime - startTime,
+    firstOutputTime,
+    peakBytes / BYTES_PER_MB,
+    (numMcus + mcusPerBand - 1) / mcusPerBand, mcusPerBand,
+    compressedBytes);
+    if (options.targetBytes) {
+        fprintf(stdout, "Rate control: %.3fs, peak %.1f MB, quality %d estimated at %zu bytes for a target of %zu\n",
+            rateStats.seconds, rateStats.peakMb(), quality, estimatedBytes, options.targetBytes);
+    }
+    if (options.memBudget && peakBytes > options.memBudget) {
+        fprintf(stderr, "warning: peak memory %.1f MB is over the %.1f MB budget\n",
+            peakBytes / BYTES_PER_MB, options.memBudget / BYTES_PER_MB);
+    }
 }
 
-void encodeOmp(const char* infile, const char* outfile, const char* compressedFile) {
-    std::shared_ptr<JpegEncoded> jpegEncoded = jpegPar(infile, outfile, compressedFile);
-    std::vector<std::shared_ptr<EncodedBlock>> encodedBlocks = jpegEncoded->encodedBlocks;
-    std::vector<unsigned char> imgRecovered = jpegDecodeSeq(jpegEncoded, outfile);
+template <typename T>
+void encodeOmp(const char* infile, const char* outfile, const char* compressedFile, const EncodeOptions& options) {
+    jpegPar<T>(infile, outfile, compressedFile, options);
+    std::vector<unsigned char> imgRecovered = jpegDecodeSeq<T>(compressedFile, outfile, options.dctKernel, options.decodeScale);
+    reportPsnr(infile, imgRecovered);
+}
+
+template <typename T>
+void encode(int omp, const char* infile, const char* outfile, const char* compressedFile, const EncodeOptions& options) {
+    if (omp) {
+        encodeOmp<T>(infile, outfile, compressedFile, options);
+    } else {
+        encodeSeq<T>(infile, outfile, compressedFile, options);
+    }
 }
 
 int main(int argc, char** argv) {
     std::string filename = argv[1];
     int opt;
     int omp = 0;
-    while ((opt = getopt(argc, argv, ":o")) != -1) {
+    std::string precision = "double";
+    EncodeOptions options;
+    static struct option long_options[] = {
+        {"precision", required_argument, 0, 'P'},
+        {"mem-budget", required_argument, 0, 'M'},
+        {"band-rows", required_argument, 0, 'B'},
+        {"dct", required_argument, 0, 'D'},
+        {"simd", required_argument, 0, 'S'},
+        {"scale", required_argument, 0, 'C'},
+        {"subsampling", required_argument, 0, 'U'},
+        {"quality", required_argument, 0, 'Q'},
+        {"target-size", required_argument, 0, 'T'},
+        {"rdo", no_argument, 0, 'R'},
+        {0, 0, 0, 0}
+    };
+    while ((opt = getopt_long(argc, argv, ":o", long_options, NULL)) != -1) {
         switch (opt) {
             case 'o':
                 omp = 1;
                 break;
+            case 'P':
+                precision = optarg;
+                break;
+            case 'M':
+                // budget is given in MB
+                options.memBudget = (size_t) (atof(optarg) * BYTES_PER_MB);
+                break;
+            case 'B':
+                options.bandRows = atoi(optarg);
+                break;
+            case 'D':
+                if (!parseDctKernel(optarg, options.dctKernel)) {
+                    fprintf(stderr, "Unknown DCT kernel %s, expected matrix, aan or llm\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                if (options.dctKernel != DCT_MATRIX && MACROBLOCK_SIZE != FAST_DCT_SIZE) {
+                    fprintf(stderr, "The %s DCT only transforms %dx%d blocks, this build uses %dx%d\n",
+                        optarg, FAST_DCT_SIZE, FAST_DCT_SIZE, MACROBLOCK_SIZE, MACROBLOCK_SIZE);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'S': {
+                // the transforms default to the widest level the CPU has
+                SimdLevel level;
+                if (!parseSimdLevel(optarg, level)) {
+                    fprintf(stderr, "Unknown SIMD level %s, expected none, sse2, avx2 or avx512\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                if (!setDctSimdLevel(level)) {
+                    fprintf(stderr, "This CPU only supports SIMD up to %s\n", simdLevelName(detectSimdLevel()));
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 'C':
+                // 1/8 of a block has to be at least one pixel
+                options.decodeScale = atoi(optarg);
+                if ((options.decodeScale != 1 && options.decodeScale != 2 && options.decodeScale != 4
+                     && options.decodeScale != 8) || options.decodeScale > MACROBLOCK_SIZE) {
+                    fprintf(stderr, "Unsupported decode scale 1/%s, expected 1, 2, 4 or 8 (at most %d)\n", optarg, MACROBLOCK_SIZE);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'U':
+                if (!parseChromaSubsampling(optarg, options.chromaSubsampling)) {
+                    fprintf(stderr, "Unknown chroma subsampling %s, expected 444, 422 or 420\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'Q':
+                options.quality = atoi(optarg);
+                if (options.quality < 1 || options.quality > 100) {
+                    fprintf(stderr, "Quality %s is out of range, expected 1 to 100\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'T':
+                // target is given in KB
+                options.targetBytes = (size_t) (atof(optarg) * 1024);
+                if (options.targetBytes == 0) {
+                    fprintf(stderr, "Target size %s is not a positive number of KB\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'R':
+                options.rdo = true;
+                break;
             default:
-                fprintf(stderr, "Usage: %s [image] [-o]\n", argv[0]);
+                fprintf(stderr, "Usage: %s [image] [-o] [--precision=double|float|int16] [--mem-budget=MB] [--band-rows=N] [--dct=matrix|aan|llm] [--simd=none|sse2|avx2|avx512] [--scale=1|2|4|8] [--subsampling=444|422|420] [--quality=1..100] [--target-size=KB] [--rdo]\n", argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
@@ -341,10 +622,15 @@ int main(int argc, char** argv) {
     std::string image = std::string("images/") + filename + std::string(".png");
     std::string compressed = std::string("compressed/") + filename + std::string(".jpeg");
 
-    if (omp) {
-        encodeOmp(raw_image.c_str(), image.c_str(), compressed.c_str());
+    if (precision == "double") {
+        encode<double>(omp, raw_image.c_str(), image.c_str(), compressed.c_str(), options);
+    } else if (precision == "float") {
+        encode<float>(omp, raw_image.c_str(), image.c_str(), compressed.c_str(), options);
+    } else if (precision == "int16") {
+        encode<int16_t>(omp, raw_image.c_str(), image.c_str(), compressed.c_str(), options);
     } else {
-        encodeSeq(raw_image.c_str(), image.c_str(), compressed.c_str());
+        fprintf(stderr, "Unknown precision %s, expected double, float or int16\n", precision.c_str());
+        exit(EXIT_FAILURE);
     }
 
     exit(EXIT_SUCCESS);
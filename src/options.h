@@ -0,0 +1,33 @@
+#include <cstddef>
+#include "image.h"
+#include "dct.h"
+#include "quantize.h"
+
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+// Encoder settings taken from the command line
+struct EncodeOptions {
+    // Memory the encode should stay under, in bytes; 0 means unlimited
+    size_t memBudget;
+    // Pixel rows converted, encoded and written out at a time
+    int bandRows;
+    // Transform kernel of the DCT and IDCT
+    DctKernel dctKernel;
+    // The decoded image is written at 1/decodeScale of the input size
+    int decodeScale;
+    // Chroma resolution of colour images; grayscale has no chroma
+    ChromaSubsampling chromaSubsampling;
+    // Quality, 1 to 100, the quantization tables are scaled to
+    int quality;
+    // Compressed size to fit, in bytes: the quality is then the highest
+    // estimated to fit it. 0 encodes at <quality>
+    size_t targetBytes;
+    // Quantize by rdoQuantize(), for smaller output at more CPU
+    bool rdo;
+
+    EncodeOptions() : memBudget(0), bandRows(MACROBLOCK_SIZE), dctKernel(DCT_MATRIX), decodeScale(1),
+                      chromaSubsampling(CHROMA_420), quality(DEFAULT_QUALITY), targetBytes(0), rdo(false) {}
+};
+
+#endif
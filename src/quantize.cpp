@@ -1,42 +1,179 @@
+#include <algorithm>
 #include "quantize.h"
+#include "rle.h"
 
-// Quantization per channel for NxN block
-// If <all> set, then YCbCr each have Quantize operation performed on them.
-// Else, only Y has Quantize operation performed on it.
-std::vector<std::shared_ptr<PixelYcbcr>> quantize(std::vector<std::shared_ptr<PixelYcbcr>> pixels, int block_size, bool all) {
+QuantMatrix scaledQuantMatrix(QuantTableId id, int quality) {
+    int scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+    QuantMatrix matrix;
+    for (int i = 0; i < 64; i++) {
+        // rounded, and kept to a step a byte holds
+        int step = (quant_matrices[id][i] * scale + 50) / 100;
+        matrix[i] = std::min(std::max(step, 1), 255);
+    }
+    return matrix;
+}
 
-    if (block_size != QUANTIZEBLOCK_SIZE) {
-        fprintf(stderr, "Quantization only supports %dx%d blocks!\n", QUANTIZEBLOCK_SIZE, QUANTIZEBLOCK_SIZE);
-        exit(1);
+template <int N>
+QuantTable<N>::QuantTable(const QuantMatrix& matrix) : matrix(matrix) {
+    for (int i = 0; i < N * N; i++) {
+        // coefficient (u, v) takes the step of the 8x8 coefficient at the
+        // same frequency
+        steps[i] = matrix[(i / N) * 8 / N * 8 + (i % N) * 8 / N] * N / 8.0;
+    }
+    for (int k = 0; k < NUM_DCT_KERNELS; k++) {
+        DctKernel kernel = N == FAST_DCT_SIZE ? (DctKernel) k : DCT_MATRIX;
+        for (int i = 0; i < N * N; i++) {
+            double step = steps[i] * dctForwardScale(kernel, i);
+            reciprocals[k].full[i] = 1.0 / step;
+            reciprocals[k].single[i] = (float) (1.0 / step);
+            multipliers[k][i] = steps[i] * dctInverseScale(kernel, i);
+        }
     }
+}
+
+// Quantization of a run of NxN blocks of one component
+// Reads <in> and writes <out>, which may be the same blocks.
+template <typename T, int N>
+void quantize(Span<const T> in, Span<T> out, const QuantTable<N>& table, DctKernel kernel) {
 
-    for (int i = 0; i < block_size*block_size; i++) {
-        pixels[i]->y = pixels[i]->y / quant_matrix[i];
-        if (all) {
-            pixels[i]->cr = pixels[i]->cr / quant_matrix[i];
-            pixels[i]->cb = pixels[i]->cb / quant_matrix[i];
+    const double* reciprocals = table.reciprocals[kernel].full;
+    for (size_t b = 0; b < in.size(); b += N * N) {
+        for (int i = 0; i < N * N; i++) {
+            out[b + i] = fromDouble<T>(rint(in[b + i] * reciprocals[i]));
         }
     }
-    return pixels;
 }
 
-// Undo quantization per channel for NxN block
-// If <all> set, then YCbCr each have undo quantize operation performed on them.
-// Else, only Y has undo quantize operation performed on it.
-std::vector<std::shared_ptr<PixelYcbcr>> unquantize(std::vector<std::shared_ptr<PixelYcbcr>> pixels, int block_size, bool all) {
+// Squared error, in orthonormal coefficients (and so in samples), that
+// one byte of encoded block is worth to rdoQuantize(), per squared step
+// of the DC coefficient: a coarser table trades more error for a byte
+#define RDO_LAMBDA 0.5
+
+// Rate-distortion optimized quantization of a run of NxN blocks, one
+// greedy pass over each block's AC coefficients in reverse zigzag order.
+// A trellis over the runs alone would miss the symbol table, which the
+// whole block shares, so each choice is costed on the whole block.
+template <typename T, int N>
+void rdoQuantize(Span<const T> in, Span<T> out, const QuantTable<N>& table, DctKernel kernel) {
 
-    if (block_size != QUANTIZEBLOCK_SIZE) {
-        fprintf(stderr, "Undo quantization only supports %dx%d blocks!\n", QUANTIZEBLOCK_SIZE, QUANTIZEBLOCK_SIZE);
-        exit(1);
+    const double* reciprocals = table.reciprocals[kernel].full;
+    const std::array<int, N * N>& zigzag = BlockTables<N>::zigzag;
+    double lambda = RDO_LAMBDA * table.steps[0] * table.steps[0];
+    for (size_t b = 0; b < in.size(); b += N * N) {
+        // coefficients in units of their steps, and rounded to nearest, in
+        // zigzag order
+        double scaled[N * N];
+        Coefficient coeffs[N * N];
+        int last = 0;
+        for (int pos = 0; pos < N * N; pos++) {
+            int idx = zigzag[pos];
+            scaled[pos] = in[b + idx] * reciprocals[idx];
+            coeffs[pos] = toCoefficient(rint(scaled[pos]));
+            last = coeffs[pos] != 0 ? pos : last;
+        }
+
+        // the positions past the original last nonzero value stay zero
+        Span<const Coefficient> values(coeffs, last + 1);
+        size_t bytes = estimateEncodedBlockBytes(values);
+        for (int pos = last; pos > 0; pos--) {
+            Coefficient nearest = coeffs[pos];
+            if (nearest == 0) {
+                continue;
+            }
+            double step = table.steps[zigzag[pos]];
+            double weight = step * step;
+            Coefficient best = nearest;
+            double best_cost = (scaled[pos] - nearest) * (scaled[pos] - nearest) * weight;
+            size_t best_bytes = bytes;
+            // rounded down, then zero; the same for a value of +-1
+            Coefficient candidates[2] = {(Coefficient) (nearest > 0 ? nearest - 1 : nearest + 1), 0};
+            for (int c = (candidates[0] == 0 ? 1 : 0); c < 2; c++) {
+                coeffs[pos] = candidates[c];
+                size_t candidate_bytes = estimateEncodedBlockBytes(values);
+                double cost = (scaled[pos] - candidates[c]) * (scaled[pos] - candidates[c]) * weight
+                    - lambda * ((double) bytes - (double) candidate_bytes);
+                if (cost < best_cost) {
+                    best = candidates[c];
+                    best_cost = cost;
+                    best_bytes = candidate_bytes;
+                }
+            }
+            coeffs[pos] = best;
+            bytes = best_bytes;
+        }
+
+        for (int pos = 0; pos < N * N; pos++) {
+            out[b + zigzag[pos]] = static_cast<T>(coeffs[pos]);
+        }
     }
+}
 
-    for (int i = 0; i < block_size*block_size; i++) {
-        pixels[i]->y = pixels[i]->y * quant_matrix[i];
-        if (all) {
-            pixels[i]->cr = pixels[i]->cr * quant_matrix[i];
-            pixels[i]->cb = pixels[i]->cb * quant_matrix[i];
+// Forward DCT and quantization of NxN blocks in one pass over them
+template <typename T, int N>
+void dctQuantize(Span<const T> in, Span<T> out, const QuantTable<N>& table, DctKernel kernel) {
+    DCT<T, N>(in, out, kernel, &table.reciprocals[kernel]);
+}
+
+// Forward DCT and quantization of part of a plane, taking the runs of
+// blocks between uniform ones through the transform a run at a time
+template <typename T, int N>
+int dctQuantizeBlocks(BlockPlane<T>& plane, int first, int count, const QuantTable<N>& table,
+                      DctKernel kernel, bool rdo) {
+
+    int end = first + count;
+    int uniform = 0;
+    int i = first;
+    while (i < end) {
+        if (plane.extent[i] == 1) {
+            // the orthonormal DC coefficient of N x N samples of value v is N v
+            T* block = plane.block(i);
+            block[0] = fromDouble<T>(rint(N * (double) block[0] / table.steps[0]));
+            std::fill(block + 1, block + N * N, T(0));
+            uniform++;
+            i++;
+            continue;
+        }
+        int run_end = i + 1;
+        while (run_end < end && plane.extent[run_end] != 1) {
+            run_end++;
         }
+        Span<T> run = plane.blocks(i, run_end - i);
+        if (rdo) {
+            DCT<T, N>(run, run, kernel);
+            rdoQuantize<T, N>(run, run, table, kernel);
+        } else {
+            dctQuantize<T, N>(run, run, table, kernel);
+        }
+        i = run_end;
     }
-    return pixels;
+    return uniform;
+}
+
+// Undo quantization of a run of NxN blocks of one component
+// Reads <in> and writes <out>, which may be the same blocks.
+template <typename T, int N>
+void unquantize(Span<const T> in, Span<T> out, const QuantTable<N>& table, DctKernel kernel) {
 
+    const double* multipliers = table.multipliers[kernel];
+    for (size_t b = 0; b < in.size(); b += N * N) {
+        for (int i = 0; i < N * N; i++) {
+            out[b + i] = fromDouble<T>(in[b + i] * multipliers[i]);
+        }
+    }
 }
+
+#define INSTANTIATE_QUANTIZE_SIZE(T, N) \
+    template void quantize<T, N>(Span<const T> in, Span<T> out, const QuantTable<N>& table, DctKernel kernel); \
+    template void rdoQuantize<T, N>(Span<const T> in, Span<T> out, const QuantTable<N>& table, DctKernel kernel); \
+    template void dctQuantize<T, N>(Span<const T> in, Span<T> out, const QuantTable<N>& table, DctKernel kernel); \
+    template int dctQuantizeBlocks<T, N>(BlockPlane<T>& plane, int first, int count, const QuantTable<N>& table, \
+                                         DctKernel kernel, bool rdo); \
+    template void unquantize<T, N>(Span<const T> in, Span<T> out, const QuantTable<N>& table, DctKernel kernel);
+#define INSTANTIATE_QUANTIZE(T) FOR_EACH_BLOCK_SIZE(INSTANTIATE_QUANTIZE_SIZE, T)
+
+FOR_EACH_SAMPLE_TYPE(INSTANTIATE_QUANTIZE)
+
+#define INSTANTIATE_QUANT_TABLE(T, N) \
+    template struct QuantTable<N>;
+
+FOR_EACH_BLOCK_SIZE(INSTANTIATE_QUANT_TABLE, )
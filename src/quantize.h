@@ -1,27 +1,84 @@
 #include "math.h"
 #include "image.h"
+#include "dct.h"
+#include "blocktables.h"
 
-#define QUANTIZEBLOCK_SIZE 8
-
-// https://en.wikipedia.org/wiki/Quantization_(image_processing)#Frequency_quantization_for_image_compression
-const std::vector<double> quant_matrix = {
-    16, 11, 10, 16, 24,  40,  51,  61,
-    12, 12, 14, 19, 26,  58,  60,  55,
-    14, 13, 16, 24, 40,  57,  69,  56,
-    14, 17, 22, 29, 51,  87,  80,  62,
-    18, 22, 37, 56, 68,  109, 103, 77,
-    24, 35, 55, 64, 81,  104, 113, 92,
-    49, 64, 78, 87, 103, 121, 120, 101,
-    72, 92, 95, 98, 112, 100, 103, 99
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+// Quality the encoder scales its tables to unless told otherwise: at 50
+// they are the tables of the JPEG standard as they stand
+#define DEFAULT_QUALITY 50
+
+// The JPEG standard's table <id> scaled to <quality>, 1 to 100, the way
+// the IJG library scales it: below 50 every step grows by 50 / quality,
+// above it every step shrinks towards 1 at quality 100
+QuantMatrix scaledQuantMatrix(QuantTableId id, int quality);
+
+// Table that quantizes component <chan>
+inline QuantTableId quantTableOf(int chan) {
+    return chan == 0 ? QUANT_LUMA : QUANT_CHROMA;
+}
+
+// A quantization table of NxN blocks, built once per encode or decode
+// from the 8x8 steps of <matrix>: each step is resampled to the block
+// size, scaled by N / 8 since the orthonormal DCT of an NxN block grows
+// with N, and the scale of each DCT kernel is folded in, so quantizing a
+// kernel's coefficients is one multiply by a reciprocal each and undoing
+// it one multiply by the step. Block sizes other than FAST_DCT_SIZE
+// always run the unscaled matrix kernel.
+template <int N>
+struct QuantTable {
+    QuantMatrix matrix;
+    // steps of the orthonormal coefficients
+    double steps[N * N];
+    ReciprocalTable<N> reciprocals[NUM_DCT_KERNELS];
+    double multipliers[NUM_DCT_KERNELS][N * N];
+
+    QuantTable(const QuantMatrix& matrix);
 };
 
-// Quantization per channel for NxN block
-// If <all> set, then YCbCr each have Quantize operation performed on them.
-// Else, only Y has Quantize operation performed on it.
-std::vector<std::shared_ptr<PixelYcbcr>> quantize(std::vector<std::shared_ptr<PixelYcbcr>> pixels, int block_size, bool all);
+// Quantization of NxN blocks of one component by <table>
+// Reads <in> and writes <out>, which may be the same blocks: a single
+// block or a run of them, as for DCT().
+// <in> is the output of <kernel>'s DCT, whose scale is divided out here.
+// Coefficients are rounded to the nearest integer.
+// N is the block size, one of FOR_EACH_BLOCK_SIZE.
+template <typename T, int N>
+void quantize(Span<const T> in, Span<T> out, const QuantTable<N>& table, DctKernel kernel = DCT_MATRIX);
+
+// Rate-distortion optimized quantization of NxN blocks of one component
+// by <table>, as quantize() but at a cost in CPU: each AC coefficient
+// is rounded to nearest, then, from the highest frequency down, rounded
+// towards zero by one or zeroed instead where the bytes that saves the
+// encoded block, by estimateEncodedBlockBytes(), are worth more than the
+// squared error it adds. Coefficients zeroed at the end of the block
+// shorten its runs, and values brought in line with their neighbours
+// join their runs or drop out of its symbol table.
+template <typename T, int N>
+void rdoQuantize(Span<const T> in, Span<T> out, const QuantTable<N>& table, DctKernel kernel = DCT_MATRIX);
+
+// Forward DCT and quantization of NxN blocks in one pass: the same as
+// DCT() then quantize(), but each coefficient is quantized as the
+// transform writes it, so the blocks are only read and written once.
+template <typename T, int N>
+void dctQuantize(Span<const T> in, Span<T> out, const QuantTable<N>& table, DctKernel kernel = DCT_MATRIX);
+
+// Forward DCT and quantization of blocks [first, first + count) of
+// <plane>, as dctQuantize(), except that blocks of extent 1 skip the
+// transform: a uniform block's DC coefficient follows from its sample
+// value, and its AC coefficients are zero. Returns the number of blocks
+// that took this fast path.
+// With <rdo>, the other blocks are transformed, then quantized by
+// rdoQuantize() rather than in the same pass.
+template <typename T, int N>
+int dctQuantizeBlocks(BlockPlane<T>& plane, int first, int count, const QuantTable<N>& table,
+                      DctKernel kernel = DCT_MATRIX, bool rdo = false);
 
-// Undo quantization per channel for NxN block
-// If <all> set, then YCbCr each have undo quantize operation performed on them.
-// Else, only Y has undo quantize operation performed on it.
-std::vector<std::shared_ptr<PixelYcbcr>> unquantize(std::vector<std::shared_ptr<PixelYcbcr>> pixels, int block_size, bool all);
+// Undo quantization of NxN blocks of one component by <table>
+// Reads <in> and writes <out>, which may be the same blocks.
+// <out> is scaled the way <kernel>'s IDCT expects its input.
+template <typename T, int N>
+void unquantize(Span<const T> in, Span<T> out, const QuantTable<N>& table, DctKernel kernel = DCT_MATRIX);
 
+#endif
@@ -0,0 +1,88 @@
+#include <algorithm>
+#include "ratecontrol.h"
+#include "quantize.h"
+#include "rle.h"
+
+template <typename T>
+std::shared_ptr<ImageBlocks<T>> rateControlBlocks(const PixelImage& pixels, int first_mcu, int num_mcus,
+                                                  int components, ChromaSubsampling subsampling, DctKernel kernel) {
+
+    std::shared_ptr<ImageBlocks<T>> blocks = convertBytesToBlocks<T>(pixels, MACROBLOCK_SIZE, first_mcu, num_mcus,
+                                                                      components, subsampling);
+    for (int chan = 0; chan < components; chan++) {
+        BlockPlane<T>& plane = blocks->component(chan);
+        #pragma omp parallel for
+        for (int i = 0; i < plane.numBlocks; i += DCT_RUN_BLOCKS) {
+            Span<T> run = plane.blocks(i, std::min(DCT_RUN_BLOCKS, plane.numBlocks - i));
+            DCT<T, MACROBLOCK_SIZE>(run, run, kernel);
+        }
+    }
+    return blocks;
+}
+
+// Bytes of the encoded block <block> of transform coefficients, once
+// quantized by <reciprocals>
+template <typename T, int N>
+static size_t estimateBlockBytes(const T* block, const double* reciprocals) {
+    const std::array<int, N * N>& zigzag = BlockTables<N>::zigzag;
+    Coefficient coeffs[N * N];
+    for (int pos = 0; pos < N * N; pos++) {
+        int idx = zigzag[pos];
+        coeffs[pos] = toCoefficient(rint(block[idx] * reciprocals[idx]));
+    }
+    return estimateEncodedBlockBytes(Span<const Coefficient>(coeffs, N * N));
+}
+
+template <typename T>
+size_t estimateEncodedBytes(const ImageBlocks<T>& blocks, int quality, DctKernel kernel) {
+
+    QuantTable<MACROBLOCK_SIZE> quantTables[NUM_QUANT_TABLES] = {scaledQuantMatrix(QUANT_LUMA, quality),
+                                                                 scaledQuantMatrix(QUANT_CHROMA, quality)};
+    size_t bytes = 0;
+    for (int chan = 0; chan < blocks.numComponents; chan++) {
+        const BlockPlane<T>& plane = blocks.component(chan);
+        const double* reciprocals = quantTables[quantTableOf(chan)].reciprocals[kernel].full;
+        #pragma omp parallel for reduction(+:bytes)
+        for (int i = 0; i < plane.numBlocks; i++) {
+            bytes += estimateBlockBytes<T, MACROBLOCK_SIZE>(plane.block(i), reciprocals);
+        }
+    }
+    return bytes;
+}
+
+template <typename T>
+size_t estimateBandedBytes(const PixelImage& pixels, int first_mcu, int num_mcus, int mcus_per_band,
+                           int components, ChromaSubsampling subsampling, int quality, DctKernel kernel) {
+
+    size_t bytes = 0;
+    for (int first = first_mcu; first < first_mcu + num_mcus; first += mcus_per_band) {
+        int band_mcus = std::min(mcus_per_band, first_mcu + num_mcus - first);
+        std::shared_ptr<ImageBlocks<T>> band = rateControlBlocks<T>(pixels, first, band_mcus, components, subsampling, kernel);
+        bytes += estimateEncodedBytes(*band, quality, kernel);
+    }
+    return bytes;
+}
+
+int searchQuality(size_t target_bytes, const std::function<size_t(int quality)>& estimate) {
+    // the answer is in [low, high]
+    int low = 1;
+    int high = 100;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (estimate(mid) <= target_bytes) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+#define INSTANTIATE_RATE_CONTROL(T) \
+    template std::shared_ptr<ImageBlocks<T>> rateControlBlocks<T>(const PixelImage& pixels, int first_mcu, int num_mcus, \
+        int components, ChromaSubsampling subsampling, DctKernel kernel); \
+    template size_t estimateEncodedBytes<T>(const ImageBlocks<T>& blocks, int quality, DctKernel kernel); \
+    template size_t estimateBandedBytes<T>(const PixelImage& pixels, int first_mcu, int num_mcus, int mcus_per_band, \
+        int components, ChromaSubsampling subsampling, int quality, DctKernel kernel);
+
+FOR_EACH_SAMPLE_TYPE(INSTANTIATE_RATE_CONTROL)
@@ -0,0 +1,37 @@
+#include <memory>
+#include <functional>
+#include "image.h"
+#include "dct.h"
+
+#ifndef RATECONTROL_H
+#define RATECONTROL_H
+
+// Blocks of MCUs [first_mcu, first_mcu + num_mcus) of <pixels>, every one
+// transformed by <kernel> and left unquantized, for the rate control to
+// quantize at each quality it tries. All of them are held at once.
+template <typename T>
+std::shared_ptr<ImageBlocks<T>> rateControlBlocks(const PixelImage& pixels, int first_mcu, int num_mcus,
+                                                  int components, ChromaSubsampling subsampling, DctKernel kernel);
+
+// Bytes the encoded blocks of <blocks> would take at <quality>, without
+// building their symbol tables or runs: each block is quantized, and its
+// runs and distinct values counted, in zigzag order as RLE() takes them.
+// Exact but for the rounding of the fused quantizer and for AC values
+// outside [-32, 31], which count as distinct however often they repeat.
+template <typename T>
+size_t estimateEncodedBytes(const ImageBlocks<T>& blocks, int quality, DctKernel kernel);
+
+// Bytes the encoded blocks of MCUs [first_mcu, first_mcu + num_mcus) of
+// <pixels> would take at <quality>, as estimateEncodedBytes() counts
+// them, for a memory budget: the blocks are transformed again on every
+// call, <mcus_per_band> MCUs at a time, so only one band of them is held.
+template <typename T>
+size_t estimateBandedBytes(const PixelImage& pixels, int first_mcu, int num_mcus, int mcus_per_band,
+                           int components, ChromaSubsampling subsampling, int quality, DctKernel kernel);
+
+// Highest quality, 1 to 100, whose <estimate> of the compressed bytes is
+// at most <target_bytes>, by binary search, so <estimate> must not shrink
+// as quality rises; 1 if even that is over
+int searchQuality(size_t target_bytes, const std::function<size_t(int quality)>& estimate);
+
+#endif
@@ -1,212 +1,130 @@
 #include <algorithm>
 #include "rle.h"
 
+#define ZIGZAG_ORDER_CASE(T, N) case N: return BlockTables<N>::zigzag.data();
+
+// Row-major index of the coefficient at each zigzag position of a
+// block_size x block_size block
+static const int* zigzagOrder(int block_size) {
+    switch (block_size) {
+        FOR_EACH_BLOCK_SIZE(ZIGZAG_ORDER_CASE, )
+    }
+    return NULL;
+}
+
 // Takes in vectorized set of AC values in macroblock and performs
 // run length encoding (codeword => value) to compress the block.
 // AC values are the values in the macroblock where they are not
-// located at (0,0).
-std::shared_ptr<EncodedBlock> RLE(std::vector<std::shared_ptr<PixelYcbcr>> block, int block_size) {
-
-    std::shared_ptr<EncodedBlock> result(new EncodedBlock());
-
-    std::shared_ptr<EncodedBlockColor> result_y = buildTable(block, COLOR_Y, block_size);
-    encodeValues(block, result_y, COLOR_Y);
-    result->y = result_y;
-
-    std::shared_ptr<EncodedBlockColor> result_cr = buildTable(block, COLOR_CR, block_size);
-    encodeValues(block, result_cr, COLOR_CR);
-    result->cr = result_cr;
-
-    std::shared_ptr<EncodedBlockColor> result_cb = buildTable(block, COLOR_CB, block_size);
-    encodeValues(block, result_cb, COLOR_CB);
-    result->cb = result_cb;
+// located at (0,0). They are taken in zigzag order, low frequencies
+// first, so the zeros of the high frequencies trail, and the runs stop
+// at the last nonzero one: running out of runs marks the end of the
+// block.
+//
+// The encoded block and all of its tables are allocated from <arena>.
+template <typename T>
+EncodedBlockColor* RLE(Span<const T> block, int block_size, Arena& arena) {
+
+    // the block is quantized, so its values are integers: the table and
+    // runs are built on them as such
+    const int* zigzag = zigzagOrder(block_size);
+    Coefficient coeffs[MACROBLOCK_PIXELS];
+    int n = block_size * block_size;
+    int last = 0;
+    for (int pos = 0; pos < n; pos++) {
+        coeffs[pos] = toCoefficient(block[zigzag[pos]]);
+        last = coeffs[pos] != 0 ? pos : last;
+    }
 
+    EncodedBlockColor* result = arena.create<EncodedBlockColor>(&arena);
+    result->dc_val = coeffs[0];
+    if (last == 0) {
+        // no nonzero AC values at all, as in every uniform block: the DC
+        // value alone, with an empty table and no runs
+        return result;
+    }
+    Span<const Coefficient> values(coeffs, last + 1);
+    buildTable(values, block_size, result);
+    encodeValues(values, result);
     return result;
 }
 
-std::vector<std::shared_ptr<PixelYcbcr>> decodeRLE( std::shared_ptr<EncodedBlock> encoded, int block_size) {
+// The runs fill the block from zigzag position 1 on, and every position
+// past them is zero
+template <typename T>
+int decodeRLE(const EncodedBlockColor& encoded, Span<T> block, int block_size) {
 
-    std::vector<std::shared_ptr<PixelYcbcr>> result(block_size * block_size);
-    for (unsigned int i = 0; i < result.size(); i++) {
-        result[i] = std::make_shared<PixelYcbcr>();
-    }
+    const int* zigzag = zigzagOrder(block_size);
+    // last row and column holding a nonzero AC value
+    int last_row = 0;
+    int last_col = 0;
 
-    // Decode y channel
-    unsigned int y_idx = 0;
-    std::shared_ptr<EncodedBlockColor> y_channel = encoded->y;
-    std::shared_ptr<std::vector<RleTuple>> tups = y_channel->encoded;
+    // zero runs are left as they are filled here
+    std::fill(block.begin(), block.begin() + block_size * block_size, T(0));
 
     // Decode DC value first
-    result[y_idx]->y = y_channel->dc_val;
-    y_idx++;
+    block[0] = static_cast<T>(encoded.dc_val);
 
     // Decode AC values after
-    for (RleTuple tup : *tups) {
-        std::shared_ptr<std::map<char, double>> decode_table = y_channel->decode_table;
-        std::map<char, double> decode_table_ptr = *decode_table;
-        char encoded = tup.encoded;
-        char freq = tup.count;
-        double decoded_val = decode_table_ptr[encoded];
-        for (char c = 0; c < freq; c++) {
-            result[y_idx]->y = decoded_val;
-            y_idx++;
+    int n = block_size * block_size;
+    int pos = 1;
+    for (RleTuple tup : encoded.encoded) {
+        // a symbol past the table or a run past the block is corrupt
+        if (tup.encoded >= encoded.table.size || tup.count > n - pos) {
+            return 0;
         }
-    }
-
-    // Decode cr channel
-    unsigned int cr_idx = 0;
-    std::shared_ptr<EncodedBlockColor> cr_channel = encoded->cr;
-    tups = cr_channel->encoded;
-
-    // Decode DC value first
-    result[cr_idx]->cr = cr_channel->dc_val;
-    cr_idx++;
-
-    // Decode AC values after
-    for (RleTuple tup : *tups) {
-        std::shared_ptr<std::map<char, double>> decode_table = cr_channel->decode_table;
-        std::map<char, double> decode_table_ptr = *decode_table;
-        char encoded = tup.encoded;
-        char freq = tup.count;
-        double decoded_val = decode_table_ptr[encoded];
-        for (char c = 0; c < freq; c++) {
-            result[cr_idx]->cr = decoded_val;
-            cr_idx++;
+        Coefficient decoded_val = encoded.table.decode(tup.encoded);
+        if (decoded_val == 0) {
+            pos += tup.count;
+            continue;
         }
-    }
-
-    // Decode cb channel
-    unsigned int cb_idx = 0;
-    std::shared_ptr<EncodedBlockColor> cb_channel = encoded->cb;
-    tups = cb_channel->encoded;
-
-    // Decode DC value first
-    result[cb_idx]->cb = cb_channel->dc_val;
-    cb_idx++;
-
-    // Decode AC values after
-    for (RleTuple tup : *tups) {
-        std::shared_ptr<std::map<char, double>> decode_table = cb_channel->decode_table;
-        std::map<char, double> decode_table_ptr = *decode_table;
-        char encoded = tup.encoded;
-        char freq = tup.count;
-        double decoded_val = decode_table_ptr[encoded];
-        for (char c = 0; c < freq; c++) {
-            result[cb_idx]->cb = decoded_val;
-            cb_idx++;
+        for (int c = 0; c < tup.count; c++) {
+            int idx = zigzag[pos];
+            block[idx] = static_cast<T>(decoded_val);
+            last_row = std::max(last_row, idx / block_size);
+            last_col = std::max(last_col, idx % block_size);
+            pos++;
         }
     }
-
-    return result;
-}
-
-// Extract the relevant color channel from the macroblock
-std::vector<double> extractChannel(std::vector<std::shared_ptr<PixelYcbcr>> block, int chan) {
-    std::vector<double> block_vals(block.size());
-
-    #pragma omp parallel for
-    for (unsigned int i = 0; i < block.size(); i++) {
-        double val;
-        if (chan == COLOR_Y) {
-            val = block[i]->y;
-        } else if (chan == COLOR_CR) {
-            val = block[i]->cr;
-        } else { // chan == COLOR_CB
-            val = block[i]->cb;
-        }
-
-        if (val == -0.0) {
-            val = 0.0;
-        }
-        block_vals[i] = val;
-    }
-
-    return block_vals;
+    return std::max(last_row, last_col) + 1;
 }
 
-// Build frequency mapping of AC values
-//
-// Returns updated values into:
-// freqs (map: double => char) and
-// encodingTable (map: char => double)
-std::shared_ptr<EncodedBlockColor> buildTable( std::vector<std::shared_ptr<PixelYcbcr>> block, int chan, int block_size) {
-
-    std::shared_ptr<EncodedBlockColor> result = std::make_shared<EncodedBlockColor>();
-    result->encoded = std::make_shared<std::vector<RleTuple>>();
-    result->decode_table = std::make_shared<std::map<char,double>>();
-    result->encode_table = std::make_shared<std::map<double,char>>();
-
-    std::vector<double> block_vals = extractChannel(block, chan);
+// Build the symbol table of a channel's AC values: every distinct value,
+// sorted, so a value's symbol is its position in the table
+void buildTable(Span<const Coefficient> block_vals, int block_size, EncodedBlockColor* result) {
 
-    // Count (value => number of occurrences)
     // i = 0 is a DC value, so skip that.
-    std::map<double, char> freq;
-    #pragma omp parallel for
-    for (unsigned int i = 1; i < block_vals.size(); i++) {
-        if (freq.count(block_vals[i])) {
-            freq[block_vals[i]] += 1;
-        } else {
-            freq[block_vals[i]] = 1;
-        }
-    }
-
-    // Count (number of occurrences => [values])
-    std::map<char, std::vector<double>> encoded;
-    char num_chars = 0; // number of unique vals to encode in the block
-    std::vector<char> key_freqs;
-    for (auto& kv : freq) {
-        double key_value = kv.first;
-        char key_freq = kv.second;
-        encoded[key_freq].push_back(key_value);
-        key_freqs.push_back(key_freq);
-        num_chars++;
-    }
-
-    // sort in descending order
-    std::sort(key_freqs.begin(), key_freqs.end(), std::greater<char>());
-
-    // Condense into final frequency mapping
-    // Encoded Value => Value
-    char curr_encoding = 0;
-    for (std::map<char, std::vector<double>>::iterator iter = encoded.begin(); iter != encoded.end(); ++iter) {
-        // char key_freq = iter->first;
-        std::vector<double> vals_to_encode = iter->second;
-        // iterate through each key_freq
-        for (double val_to_encode : vals_to_encode) {
-            (*result->encode_table)[val_to_encode] = curr_encoding;
-            (*result->decode_table)[curr_encoding] = val_to_encode;
-            curr_encoding++;
-        }
+    Coefficient* values = result->table.values;
+    int num_vals = block_vals.size() - 1;
+    for (int i = 0; i < num_vals; i++) {
+        values[i] = block_vals[i + 1];
     }
-
-    return result;
+    std::sort(values, values + num_vals);
+    result->table.size = std::unique(values, values + num_vals) - values;
 }
 
 
-// Encode values using frequency mapping for a single color channel
-void encodeValues(std::vector<std::shared_ptr<PixelYcbcr>> block, std::shared_ptr<EncodedBlockColor> color, int chan) {
-
-    std::vector<double> chan_vals = extractChannel(block, chan);
+// Encode values using the symbol table for a single color channel
+void encodeValues(Span<const Coefficient> chan_vals, EncodedBlockColor* color) {
 
     int n = chan_vals.size();
-    std::shared_ptr<std::vector<RleTuple>> encoded_ptr = color->encoded;
+    RleTupleVector* encoded_ptr = &color->encoded;
 
     // Encode the DC value
     color->dc_val = chan_vals[0];
 
     int curr_idx = 1;
     int curr_run = 1;
-    double curr_val = chan_vals[curr_idx];
+    Coefficient curr_val = chan_vals[curr_idx];
 
     // Skip 0th value because it is DC
     while (curr_idx < n - 1) {
         curr_idx++;
-        double val = chan_vals[curr_idx];
+        Coefficient val = chan_vals[curr_idx];
         if (val == curr_val) {
             curr_run++;
         } else {
             RleTuple rleTuple;
-            rleTuple.encoded = (*color->encode_table)[curr_val];
+            rleTuple.encoded = color->table.encode(curr_val);
             rleTuple.count = curr_run;
             (*encoded_ptr).push_back(rleTuple);
             curr_run = 1;
@@ -217,165 +135,194 @@ void encodeValues(std::vector<std::shared_ptr<PixelYcbcr>> block, std::shared_pt
     // Edge case: pushing back last value
     // Case 1: last value is different
     RleTuple rleTuple;
-    rleTuple.encoded = (*color->encode_table)[chan_vals[n-1]];
+    rleTuple.encoded = color->table.encode(chan_vals[n-1]);
     if (chan_vals[n-1] != chan_vals[n-2]) {
         rleTuple.count = 1;
     } else { // Case 2: last value is the same
         rleTuple.count = curr_run;
     }
-    (*color->encoded).push_back(rleTuple);
+    color->encoded.push_back(rleTuple);
+}
+
+// AC values from -SMALL_VALUES / 2 up to SMALL_VALUES / 2 - 1, most of
+// them, are told apart by a bit each
+#define SMALL_VALUES 64
+
+size_t estimateEncodedBlockBytes(Span<const Coefficient> coeffs) {
+    int last = 0;
+    for (int pos = coeffs.size() - 1; pos > 0; pos--) {
+        if (coeffs[pos] != 0) {
+            last = pos;
+            break;
+        }
+    }
+
+    int num_runs = 0;
+    int num_values = 0;
+    uint64_t small_values = 0;
+    for (int pos = 1; pos <= last; pos++) {
+        Coefficient value = coeffs[pos];
+        num_runs += pos == 1 || value != coeffs[pos - 1];
+        if (value >= -SMALL_VALUES / 2 && value < SMALL_VALUES / 2) {
+            small_values |= (uint64_t) 1 << (value + SMALL_VALUES / 2);
+        } else {
+            num_values++;
+        }
+    }
+    num_values += __builtin_popcountll(small_values);
+    return encodedBlockBytes(num_values, num_runs);
+}
+
+#define INSTANTIATE_RLE(T) \
+    template EncodedBlockColor* RLE<T>(Span<const T> block, int block_size, Arena& arena); \
+    template int decodeRLE<T>(const EncodedBlockColor& encoded, Span<T> block, int block_size);
+
+FOR_EACH_SAMPLE_TYPE(INSTANTIATE_RLE)
+
+template <typename V>
+static void writeValue(std::ostream& out, const V& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(V));
+}
+
+template <typename V>
+static bool readValue(std::istream& in, V& value) {
+    return (bool) in.read(reinterpret_cast<char*>(&value), sizeof(V));
+}
+
+// Grayscale only has luma to quantize
+static int numQuantTables(int components) {
+    return components == 1 ? 1 : NUM_QUANT_TABLES;
+}
+
+void writeHeader(std::ostream& out, unsigned int width, unsigned int height,
+                 int components, ChromaSubsampling subsampling,
+                 const QuantMatrix matrices[NUM_QUANT_TABLES]) {
+    writeValue(out, width);
+    writeValue(out, height);
+    writeValue(out, (unsigned char) components);
+    writeValue(out, (unsigned char) subsampling);
+    for (int t = 0; t < numQuantTables(components); t++) {
+        writeValue(out, matrices[t]);
+    }
+}
+
+size_t headerBytes(int components) {
+    return 2 * sizeof(unsigned int) + 2 * sizeof(unsigned char) + numQuantTables(components) * sizeof(QuantMatrix);
+}
+
+bool readHeader(std::istream& in, unsigned int& width, unsigned int& height,
+                int& components, ChromaSubsampling& subsampling,
+                QuantMatrix matrices[NUM_QUANT_TABLES]) {
+    unsigned char stored_components;
+    unsigned char stored_subsampling;
+    if (!readValue(in, width) || !readValue(in, height) ||
+        !readValue(in, stored_components) || !readValue(in, stored_subsampling)) {
+        return false;
+    }
+    components = stored_components;
+    subsampling = (ChromaSubsampling) stored_subsampling;
+    // Grayscale has no chroma to subsample
+    if (!((components == 1 && subsampling == CHROMA_444) ||
+          (components == NUM_COMPONENTS && stored_subsampling < NUM_CHROMA_SUBSAMPLINGS))) {
+        return false;
+    }
+    for (int t = 0; t < numQuantTables(components); t++) {
+        if (!readValue(in, matrices[t])) {
+            return false;
+        }
+        // a step of 0 would divide by zero
+        if (std::find(matrices[t].begin(), matrices[t].end(), 0) != matrices[t].end()) {
+            return false;
+        }
+    }
+    // no chroma is quantized by the table left out
+    for (int t = numQuantTables(components); t < NUM_QUANT_TABLES; t++) {
+        matrices[t] = matrices[QUANT_LUMA];
+    }
+    return true;
+}
+
+void writeEncodedBlock(std::ostream& out, const EncodedBlockColor& color) {
+    writeValue(out, color.dc_val);
+    writeValue(out, color.table.size);
+    out.write(reinterpret_cast<const char*>(color.table.values), color.table.size * sizeof(Coefficient));
+    RleCode num_runs = color.encoded.size();
+    writeValue(out, num_runs);
+    out.write(reinterpret_cast<const char*>(color.encoded.data()), num_runs * sizeof(RleTuple));
+}
+
+bool readEncodedBlock(std::istream& in, EncodedBlockColor& color) {
+    RleCode num_runs;
+    if (!readValue(in, color.dc_val) || !readValue(in, color.table.size)) {
+        return false;
+    }
+    // a block has no more distinct AC values, or runs of them, than AC values
+    if (color.table.size > SYMBOL_TABLE_CAPACITY ||
+        !in.read(reinterpret_cast<char*>(color.table.values), color.table.size * sizeof(Coefficient))) {
+        return false;
+    }
+    if (!readValue(in, num_runs) || num_runs > SYMBOL_TABLE_CAPACITY) {
+        return false;
+    }
+    color.encoded.resize(num_runs);
+    return (bool) in.read(reinterpret_cast<char*>(color.encoded.data()), num_runs * sizeof(RleTuple));
 }
 
 // Write the encoded blocks  without pointers from the
 // worker to buffer for MPI send back to master
 void writeToBuffer(
-    std::shared_ptr<EncodedBlockNoPtr> encodedBlockBuffer,
-    std::vector<std::shared_ptr<EncodedBlock>> encodedBlocks,
-    int idx, int chan) {
+    std::shared_ptr<EncodedBlockColorNoPtr> encodedBlockBuffer,
+    const std::vector<EncodedBlockColor*>& encodedBlocks,
+    int idx) {
 
     // Get encoded block from vector of encoded blocks
-    std::shared_ptr<EncodedBlock> encodedBlock = encodedBlocks[idx];
+    const EncodedBlockColor* encodedBlock = encodedBlocks[idx];
+    EncodedBlockColorNoPtr& buffered = (encodedBlockBuffer.get())[idx];
 
     // Write the DC value to the buffer
-    (encodedBlockBuffer.get())[idx].y.dc_val = encodedBlock->y->dc_val;
-
-    if (chan == COLOR_Y) {
-        // Write the encoded channel values to the buffer
-        unsigned int sz = (*encodedBlock->y->encoded.get()).size();
-        for (unsigned int j = 0; j < sz; j++) {
-            (encodedBlockBuffer.get())[idx].y.encoded[j].encoded = (*encodedBlock->y->encoded.get())[j].encoded;
-            (encodedBlockBuffer.get())[idx].y.encoded[j].count = (*encodedBlock->y->encoded.get())[j].count;
-        }
-        // Write the encoded channel length to the buffer
-        (encodedBlockBuffer.get())[idx].y.encoded_len = sz;
-        // Write the dict: chars + doubles pairs to the buffer
-        int kv_idx = 0;
-        for (std::map<double, char>::iterator iter = (
-            *encodedBlock->y->encode_table).begin();
-            iter != (*encodedBlock->y->encode_table).end(); ++iter) {
-            double double_val = iter->first;
-            char char_val = iter->second;
-            (encodedBlockBuffer.get())[idx].y.char_vals[kv_idx] = char_val;
-            (encodedBlockBuffer.get())[idx].y.double_vals[kv_idx] = double_val;
-            kv_idx++;
-        }
-        // Write the table size to the buffer
-        (encodedBlockBuffer.get())[idx].y.table_size = kv_idx;
-    } else if (chan == COLOR_CR) {
-        // Write the encoded channel values to the buffer
-        unsigned int sz = (*encodedBlock->cr->encoded.get()).size();
-        for (unsigned int j = 0; j < sz; j++) {
-            (encodedBlockBuffer.get())[idx].cr.encoded[j].encoded = (*encodedBlock->cr->encoded.get())[j].encoded;
-            (encodedBlockBuffer.get())[idx].cr.encoded[j].count = (*encodedBlock->cr->encoded.get())[j].count;
-        }
-        // Write the encoded channel length to the buffer
-        (encodedBlockBuffer.get())[idx].cr.encoded_len = sz;
-        // Write the dict: chars + doubles pairs to the buffer
-        int kv_idx = 0;
-        for (std::map<double, char>::iterator iter = (
-            *encodedBlock->cr->encode_table).begin();
-            iter != (*encodedBlock->cr->encode_table).end(); ++iter) {
-            double double_val = iter->first;
-            char char_val = iter->second;
-            (encodedBlockBuffer.get())[idx].cr.char_vals[kv_idx] = char_val;
-            (encodedBlockBuffer.get())[idx].cr.double_vals[kv_idx] = double_val;
-            kv_idx++;
-        }
-        // Write the table size to the buffer
-        (encodedBlockBuffer.get())[idx].cr.table_size = kv_idx;
-    } else { // chan == COLOR_CB
-        // Write the encoded channel values to the buffer
-        unsigned int sz = (*encodedBlock->cb->encoded.get()).size();
-        for (unsigned int j = 0; j < sz; j++) {
-            (encodedBlockBuffer.get())[idx].cb.encoded[j].encoded = (*encodedBlock->cb->encoded.get())[j].encoded;
-            (encodedBlockBuffer.get())[idx].cb.encoded[j].count = (*encodedBlock->cb->encoded.get())[j].count;
-        }
-        // Write the encoded channel length to the buffer
-        (encodedBlockBuffer.get())[idx].cb.encoded_len = sz;
-        // Write the dict: chars + doubles pairs to the buffer
-        int kv_idx = 0;
-        for (std::map<double, char>::iterator iter = (
-            *encodedBlock->cb->encode_table).begin();
-            iter != (*encodedBlock->cb->encode_table).end(); ++iter) {
-            double double_val = iter->first;
-            char char_val = iter->second;
-            (encodedBlockBuffer.get())[idx].cb.char_vals[kv_idx] = char_val;
-            (encodedBlockBuffer.get())[idx].cb.double_vals[kv_idx] = double_val;
-            kv_idx++;
-        }
-        // Write the table size to the buffer
-        (encodedBlockBuffer.get())[idx].cb.table_size = kv_idx;
+    buffered.dc_val = encodedBlock->dc_val;
+    // Write the encoded channel values to the buffer
+    unsigned int sz = encodedBlock->encoded.size();
+    for (unsigned int j = 0; j < sz; j++) {
+        buffered.encoded[j].encoded = encodedBlock->encoded[j].encoded;
+        buffered.encoded[j].count = encodedBlock->encoded[j].count;
+    }
+    // Write the encoded channel length to the buffer
+    buffered.encoded_len = sz;
+    // Write the dict: chars + doubles pairs to the buffer
+    const SymbolTable& table = encodedBlock->table;
+    for (int kv_idx = 0; kv_idx < table.size; kv_idx++) {
+        buffered.char_vals[kv_idx] = kv_idx;
+        buffered.coeff_vals[kv_idx] = table.values[kv_idx];
     }
+    // Write the table size to the buffer
+    buffered.table_size = table.size;
 }
 
-// Convert encoded blocks from MPI buffer back to encoded blocks with pointers
-std::vector<std::shared_ptr<EncodedBlock>> convertBufferToEncodedBlocks(
-    std::shared_ptr<EncodedBlockNoPtr> encodedBlocksBuffer, int numEncodedBlocks) {
+// Convert encoded blocks from MPI buffer back to encoded blocks in <arena>
+std::vector<EncodedBlockColor*> convertBufferToEncodedBlocks(
+    std::shared_ptr<EncodedBlockColorNoPtr> encodedBlocksBuffer, int numEncodedBlocks,
+    Arena& arena) {
 
-    std::vector<std::shared_ptr<EncodedBlock>> result;
+    std::vector<EncodedBlockColor*> result;
 
     for (int i = 0; i < numEncodedBlocks; i++) {
-        EncodedBlockNoPtr block = (encodedBlocksBuffer.get())[i];
-        // Make result block shared pointers
-        std::shared_ptr<EncodedBlock> resultBlock = std::make_shared<EncodedBlock>();
-        resultBlock->y = std::make_shared<EncodedBlockColor>();
-        resultBlock->cr = std::make_shared<EncodedBlockColor>();
-        resultBlock->cb = std::make_shared<EncodedBlockColor>();
-        resultBlock->y->encoded = std::make_shared<std::vector<RleTuple>>();
-        resultBlock->cr->encoded = std::make_shared<std::vector<RleTuple>>();
-        resultBlock->cb->encoded = std::make_shared<std::vector<RleTuple>>();
-        resultBlock->y->decode_table = std::make_shared<std::map<char, double>>();
-        resultBlock->cr->decode_table = std::make_shared<std::map<char, double>>();
-        resultBlock->cb->decode_table = std::make_shared<std::map<char, double>>();
-        resultBlock->y->encode_table = std::make_shared<std::map<double,char>>();
-        resultBlock->cr->encode_table = std::make_shared<std::map<double,char>>();
-        resultBlock->cb->encode_table = std::make_shared<std::map<double,char>>();
-        // Copy back dc values
-        resultBlock->y->dc_val = block.y.dc_val;
-        resultBlock->cr->dc_val = block.cr.dc_val;
-        resultBlock->cb->dc_val = block.cb.dc_val;
+        const EncodedBlockColorNoPtr& buffered = (encodedBlocksBuffer.get())[i];
+        // Make result block in the arena
+        EncodedBlockColor* color = arena.create<EncodedBlockColor>(&arena);
+        // Copy back dc value
+        color->dc_val = buffered.dc_val;
         // Copy back encoded RleTuples
-        for (int j = 0; j < block.y.encoded_len; j++) {
-            RleTuple rleTuple;
-            rleTuple.encoded = block.y.encoded[j].encoded;
-            rleTuple.count = block.y.encoded[j].count;
-            (*resultBlock->y->encoded.get()).push_back(rleTuple);
-        }
-        for (int j = 0; j < block.cb.encoded_len; j++) {
-            RleTuple rleTuple;
-            rleTuple.encoded = block.cb.encoded[j].encoded;
-            rleTuple.count = block.cb.encoded[j].count;
-            (*resultBlock->cb->encoded.get()).push_back(rleTuple);
-        }
-        for (int j = 0; j < block.cr.encoded_len; j++) {
-            RleTuple rleTuple;
-            rleTuple.encoded = block.cr.encoded[j].encoded;
-            rleTuple.count = block.cr.encoded[j].count;
-            (*resultBlock->cr->encoded.get()).push_back(rleTuple);
-        }
-        // Copy back encode_table & decode_table
-        char char_val;
-        double double_val;
-        for (int j = 0; j < block.y.table_size; j++) {
-            char_val = block.y.char_vals[j];
-            double_val = block.y.double_vals[j];
-            (*resultBlock->y->encode_table.get())[double_val] = char_val;
-            (*resultBlock->y->decode_table.get())[char_val] = double_val;
-        }
-        for (int j = 0; j < block.cb.table_size; j++) {
-            char_val = block.cb.char_vals[j];
-            double_val = block.cb.double_vals[j];
-            (*resultBlock->cb->encode_table.get())[double_val] = char_val;
-            (*resultBlock->cb->decode_table.get())[char_val] = double_val;
+        for (int j = 0; j < buffered.encoded_len; j++) {
+            color->encoded.push_back(buffered.encoded[j]);
         }
-        for (int j = 0; j < block.cr.table_size; j++) {
-            char_val = block.cr.char_vals[j];
-            double_val = block.cr.double_vals[j];
-            (*resultBlock->cr->encode_table.get())[double_val] = char_val;
-            (*resultBlock->cr->decode_table.get())[char_val] = double_val;
+        // Copy back the symbol table
+        for (int j = 0; j < buffered.table_size; j++) {
+            color->table.values[buffered.char_vals[j]] = buffered.coeff_vals[j];
         }
+        color->table.size = buffered.table_size;
         // Push back result
-        result.push_back(resultBlock);
+        result.push_back(color);
     }
 
     return result;
@@ -1,89 +1,153 @@
 #include <vector>
-#include <map>
 #include <memory>
+#include <iostream>
+#include <climits>
 #include "image.h"
+#include "blocktables.h"
+#include "arena.h"
 
-#define MACROBLOCK_SIZE 8
-#define COLOR_Y  0
-#define COLOR_CR 1
-#define COLOR_CB 2
+// Symbols, run lengths and their counts: a block has MACROBLOCK_PIXELS - 1
+// AC values, so one unsigned byte holds any of them for blocks up to 16x16.
+typedef unsigned char RleCode;
 
-// Store (encoded, count) structs. Since macroblocks are 8x8 the char datatype
-// (-128 to 127) is sufficient for storing this information.
+static_assert(MACROBLOCK_PIXELS - 1 <= UCHAR_MAX, "RleCode can't count the AC values of a block");
+
+// Store (encoded, count) structs
 struct RleTuple {
-    char encoded;
-    char count;
+    RleCode encoded;
+    RleCode count;
 };
 
-struct EncodedBlockColor {
-    double dc_val;
-    std::shared_ptr<std::vector<RleTuple>> encoded;
-    std::shared_ptr<std::map<char, double>> decode_table;
-    std::shared_ptr<std::map<double, char>> encode_table;
-};
+typedef std::vector<RleTuple, ArenaAllocator<RleTuple>> RleTupleVector;
 
-struct EncodedBlock {
-    std::shared_ptr<EncodedBlockColor> y;
-    std::shared_ptr<EncodedBlockColor> cr;
-    std::shared_ptr<EncodedBlockColor> cb;
-};
+// A block has at most one distinct value per AC coefficient
+#define SYMBOL_TABLE_CAPACITY (MACROBLOCK_PIXELS - 1)
+
+// Symbol table of one encoded channel. The distinct AC values are kept
+// sorted, and a value's symbol is its index, so both directions are
+// lookups in one flat array.
+struct SymbolTable {
+    RleCode size;
+    Coefficient values[SYMBOL_TABLE_CAPACITY];
 
-struct JpegEncoded { // for helper function ease of use
-    unsigned int width;
-    unsigned int height;
-    std::vector<std::shared_ptr<EncodedBlock>> encodedBlocks;
+    SymbolTable() : size(0) {}
+
+    Coefficient decode(RleCode symbol) const { return values[symbol]; }
+
+    // The symbol of a value in the table is the number of smaller values,
+    // counted without branching
+    RleCode encode(Coefficient value) const {
+        int symbol = 0;
+        for (int i = 0; i < size; i++) {
+            symbol += values[i] < value;
+        }
+        return symbol;
+    }
 };
 
-// MIRROR STRUCTURES FOR STACK ALLOC MEMORY MATH IN MPI
-struct EncodedBlockColorNoPtr {
-    double dc_val;
-    char encoded_len;
-    RleTuple encoded[MACROBLOCK_SIZE * MACROBLOCK_SIZE];
-    char table_size;
-    char char_vals[MACROBLOCK_SIZE * MACROBLOCK_SIZE];
-    double double_vals[MACROBLOCK_SIZE * MACROBLOCK_SIZE];
+// One encoded block of a single component. It is created in an arena
+// and its run vector allocates from the same arena.
+struct EncodedBlockColor {
+    Coefficient dc_val;
+    RleTupleVector encoded;
+    SymbolTable table;
+
+    EncodedBlockColor(Arena* arena) :
+        dc_val(0),
+        encoded(ArenaAllocator<RleTuple>(arena)) {
+        encoded.reserve(SYMBOL_TABLE_CAPACITY);
+    }
 };
 
 // MIRROR STRUCTURES FOR STACK ALLOC MEMORY MATH IN MPI
-struct EncodedBlockNoPtr {
-    EncodedBlockColorNoPtr y;
-    EncodedBlockColorNoPtr cr;
-    EncodedBlockColorNoPtr cb;
+struct EncodedBlockColorNoPtr {
+    Coefficient dc_val;
+    RleCode encoded_len;
+    RleTuple encoded[MACROBLOCK_PIXELS];
+    RleCode table_size;
+    RleCode char_vals[MACROBLOCK_PIXELS];
+    Coefficient coeff_vals[MACROBLOCK_PIXELS];
 };
 
-std::shared_ptr<EncodedBlock> RLE(
-    std::vector<std::shared_ptr<PixelYcbcr>> block,
-    int block_size
-);
-
-std::vector<double> extractChannel(
-    std::vector<std::shared_ptr<PixelYcbcr>> block,
-    int chan
+// Encode one quantized block of a component; the result lives in
+// <arena>. Its values are taken as Coefficients whatever the sample type
+// T, so equal coefficients always share a symbol, and in zigzag order
+// (BlockTables::zigzag), so its trailing zeros need no runs.
+template <typename T>
+EncodedBlockColor* RLE(
+    Span<const T> block,
+    int block_size,
+    Arena& arena
 );
 
-std::shared_ptr<EncodedBlockColor> buildTable(
-    std::vector<std::shared_ptr<PixelYcbcr>> block,
-    int chan,
-    int block_size
+void buildTable(
+    Span<const Coefficient> chan_vals,
+    int block_size,
+    EncodedBlockColor* color
 );
 
 void encodeValues(
-    std::vector<std::shared_ptr<PixelYcbcr>> block,
-    std::shared_ptr<EncodedBlockColor> color,
-    int chan
+    Span<const Coefficient> chan_vals,
+    EncodedBlockColor* color
 );
 
-std::vector<std::shared_ptr<PixelYcbcr>> decodeRLE(
-    std::shared_ptr<EncodedBlock> encoded,
+// Decode one block of a component back into row-major order. Returns the
+// side of the top-left corner of the block that holds all its nonzero
+// coefficients: 1 if it is its DC value alone, or 0 if the block is
+// corrupt, its runs naming a symbol past its table or running past its
+// end.
+template <typename T>
+int decodeRLE(
+    const EncodedBlockColor& encoded,
+    Span<T> block,
     int block_size
 );
 
+// Compressed file layout: the image width and height, its number of
+// components (a byte, 1 for grayscale or NUM_COMPONENTS), its chroma
+// subsampling (a byte, a ChromaSubsampling) and the 8x8 steps of its
+// quantization tables (64 bytes each, luma then chroma, which grayscale
+// leaves out), then every encoded block in
+// the coding order of ImageBlocks::codedBlock(): MCU by MCU in row-major
+// order, each MCU its luma blocks row by row then its Cr and Cb blocks.
+// A block is written as its DC value, its symbol table (size, then
+// values), both as 16-bit Coefficients, and its runs (count, then
+// (symbol, run length) pairs). The runs cover its AC values in zigzag
+// order up to the last nonzero one, the rest being zeros, so a block
+// with no nonzero AC values has an empty table and no runs.
+void writeHeader(std::ostream& out, unsigned int width, unsigned int height,
+                 int components, ChromaSubsampling subsampling,
+                 const QuantMatrix matrices[NUM_QUANT_TABLES]);
+bool readHeader(std::istream& in, unsigned int& width, unsigned int& height,
+                int& components, ChromaSubsampling& subsampling,
+                QuantMatrix matrices[NUM_QUANT_TABLES]);
+void writeEncodedBlock(std::ostream& out, const EncodedBlockColor& block);
+// Bytes writeHeader() writes for an image of <components>
+size_t headerBytes(int components);
+// Bytes writeEncodedBlock() writes for a block of <table_size> symbols
+// and <num_runs> runs
+inline size_t encodedBlockBytes(int table_size, int num_runs) {
+    return sizeof(Coefficient) + sizeof(RleCode) + table_size * sizeof(Coefficient) +
+        sizeof(RleCode) + num_runs * sizeof(RleTuple);
+}
+// Bytes writeEncodedBlock() would write for a block whose coefficients,
+// in zigzag order, are <coeffs>, without building its symbol table or
+// runs: the runs and distinct values up to its last nonzero AC value are
+// counted. Exact but for AC values outside [-32, 31], which count as
+// distinct however often they repeat.
+size_t estimateEncodedBlockBytes(Span<const Coefficient> coeffs);
+// Read the next block of a compressed file into <block>, reusing its
+// storage
+bool readEncodedBlock(std::istream& in, EncodedBlockColor& block);
+
 void writeToBuffer(
-    std::shared_ptr<EncodedBlockNoPtr> encodedBlockBuffer,
-    std::vector<std::shared_ptr<EncodedBlock>> encodedBlocks,
-    int idx, int chan
+    std::shared_ptr<EncodedBlockColorNoPtr> encodedBlockBuffer,
+    const std::vector<EncodedBlockColor*>& encodedBlocks,
+    int idx
 );
 
-std::vector<std::shared_ptr<EncodedBlock>> convertBufferToEncodedBlocks(
-    std::shared_ptr<EncodedBlockNoPtr> encodedBlocksBuffer, int numEncodedBlocks
+// Rebuild encoded blocks from an MPI buffer; the result lives in <arena>.
+std::vector<EncodedBlockColor*> convertBufferToEncodedBlocks(
+    std::shared_ptr<EncodedBlockColorNoPtr> encodedBlocksBuffer, int numEncodedBlocks,
+    Arena& arena
 );
@@ -2,6 +2,9 @@
 #include <fstream>
 #include <cstdarg>
 #include <string>
+#include <algorithm>
+#include <functional>
+#include <cstddef>
 #include "CycleTimer.h"
 #include "getopt.h"
 #include "stdio.h"
@@ -10,9 +13,11 @@
 #include "quantize.h"
 #include "dpcm.h"
 #include "rle.h"
+#include "ratecontrol.h"
+#include "meminfo.h"
+#include "options.h"
 #include "mpi.h"
 
-#define MACROBLOCK_SIZE 8
 
 #ifndef LOGLEVEL
 #define LOGLEVEL 0 // set to 1 for logging
@@ -30,158 +35,266 @@ void log(int rank, const char* format, ...) {
     va_end(args);
 }
 
-std::shared_ptr<JpegEncoded> jpegSeq(const char* infile, const char* compressedFile) {
-    fprintf(stdout, "running sequential version\n");
+template <typename T>
+void jpegSeq(const char* infile, const char* compressedFile, const EncodeOptions& options) {
+    fprintf(stdout, "running sequential version (%s)\n", sampleTypeName<T>());
 
     double startTime = CycleTimer::currentSeconds();
 
-    std::vector<unsigned char> bytes; // The raw pixels
+    PixelImage pixels; // The raw pixels, in the PNG's own layout
     unsigned int width, height;
-
-    double loadImageStartTime = CycleTimer::currentSeconds();
-    unsigned int error = lodepng::decode(bytes, width, height, infile);
-    double loadImageStopTime = CycleTimer::currentSeconds();
-
+    StageStats loadImageStats, convertStats, rateStats, dctStats, dpcmStats, rleStats, writeStats;
+
+    // Decode
+    loadImageStats.start();
+    unsigned int error = decodePng(pixels, infile);
+    // grayscale input is encoded as luma alone, with no chroma at any stage
+    int components = isGrayscale(pixels) ? 1 : NUM_COMPONENTS;
+    bool all = components == NUM_COMPONENTS;
+    ChromaSubsampling subsampling = all ? options.chromaSubsampling : CHROMA_444;
+    loadImageStats.stop();
+    width = pixels.width;
+    height = pixels.height;
+
+    // If there's an error, display it
     if(error) {
       std::cout << "decoder error " << error << ": " << lodepng_error_text(error) << std::endl;
     } else {
       log(0, "success decoding %s!\n", infile);
     }
 
-    // 4 bytes per pixel, ordered RGBARGBA
-    log(0, "convertBytesToImage()...\n");
-    double convertBytesToImageStartTime = CycleTimer::currentSeconds();
-    std::shared_ptr<ImageRgb> imageRgb = convertBytesToImage(bytes, width, height);
-    double convertBytesToImageEndTime = CycleTimer::currentSeconds();
-
-    log(0, "convertRgbToYcbcr()...\n");
-    double convertRgbToYcbcrStartTime = CycleTimer::currentSeconds();
-    std::shared_ptr<ImageYcbcr> imageYcbcr = convertRgbToYcbcr(imageRgb);
-    double convertRgbToYcbcrEndTime = CycleTimer::currentSeconds();
-
-    log(0, "convertYcbcrToBlocks()...\n");
-    double convertYcbcrToBlocksStartTime = CycleTimer::currentSeconds();
-    std::shared_ptr<ImageBlocks> imageBlocks = convertYcbcrToBlocks(imageYcbcr, MACROBLOCK_SIZE);
-    double convertYcbcrToBlocksEndTime = CycleTimer::currentSeconds();
-
-    log(0, "DCT()...\n");
-    double dctStartTime = CycleTimer::currentSeconds();
-    std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> dcts;
-    for (auto block : imageBlocks->blocks) {
-        dcts.push_back(DCT(block, MACROBLOCK_SIZE, true));
+    // The image is streamed in bands of whole MCU rows: each band is
+    // converted, encoded and appended to the compressed file before the next
+    // one is read, so only one band's blocks are held at a time.
+    int numMcus = mcuGrid(width, height, MACROBLOCK_SIZE, subsampling).numMcus;
+    int mcusPerBand = bandMcus(pixels, MACROBLOCK_SIZE, options.bandRows, sizeof(T), options.memBudget, components, subsampling);
+    // With a target size, the image is transformed once and the quality
+    // is the highest whose estimated size fits it; only that quality is
+    // encoded. Within a memory budget the whole image's coefficients
+    // don't fit, so each estimate transforms it again band by band.
+    int quality = options.quality;
+    size_t estimatedBytes = 0;
+    if (options.targetBytes) {
+        log(0, "rate control...\n");
+        rateStats.start();
+        std::shared_ptr<ImageBlocks<T>> coefficients;
+        if (!options.memBudget) {
+            coefficients = rateControlBlocks<T>(pixels, 0, numMcus, components, subsampling, options.dctKernel);
+        }
+        std::function<size_t(int)> estimate = [&](int q) {
+            size_t bytes = coefficients ? estimateEncodedBytes(*coefficients, q, options.dctKernel)
+                : estimateBandedBytes<T>(pixels, 0, numMcus, mcusPerBand, components, subsampling, q, options.dctKernel);
+            return headerBytes(components) + bytes;
+        };
+        quality = searchQuality(options.targetBytes, estimate);
+        estimatedBytes = estimate(quality);
+        rateStats.stop();
     }
-    double dctEndTime = CycleTimer::currentSeconds();
+    ArenaPool arenas;
+    // most bytes the arenas held at once, for the RLE report
+    size_t arenaBytes = 0;
+    std::vector<EncodedBlockColor*> encodedBlocks;
+    std::ofstream jpegFile(compressedFile, std::ios::binary);
+    // the tables are scaled to the quality once, and carried in the file
+    // for the decoder
+    QuantMatrix matrices[NUM_QUANT_TABLES] = {scaledQuantMatrix(QUANT_LUMA, quality),
+                                              scaledQuantMatrix(QUANT_CHROMA, quality)};
+    QuantTable<MACROBLOCK_SIZE> quantTables[NUM_QUANT_TABLES] = {matrices[QUANT_LUMA], matrices[QUANT_CHROMA]};
+    writeHeader(jpegFile, width, height, components, subsampling, matrices);
+    double firstOutputTime = 0;
+    Coefficient prevDc[3] = {0, 0, 0};
+    // blocks that skipped the DCT, being uniform, out of all coded blocks
+    int uniformBlocks = 0;
+    int numBlocks = 0;
+    for (int firstMcu = 0; firstMcu < numMcus; firstMcu += mcusPerBand) {
+        int numBandMcus = std::min(mcusPerBand, numMcus - firstMcu);
+
+        // pixels go straight into padded, subsampled YCbCr blocks
+        log(0, "convertBytesToBlocks()...\n");
+        convertStats.start();
+        std::shared_ptr<ImageBlocks<T>> imageBlocks = convertBytesToBlocks<T>(pixels, MACROBLOCK_SIZE, firstMcu, numBandMcus, components, subsampling);
+        convertStats.stop();
+        numBlocks += imageBlocks->numCodedBlocks();
+
+        // each block is quantized as it is transformed, in one pass, a run
+        // of blocks of a component at a time; uniform blocks skip the
+        // transform
+        log(0, "dctQuantize()...\n");
+        dctStats.start();
+        for (int chan = 0; chan < components; chan++) {
+            BlockPlane<T>& plane = imageBlocks->component(chan);
+            for (int i = 0; i < plane.numBlocks; i += DCT_RUN_BLOCKS) {
+                uniformBlocks += dctQuantizeBlocks<T, MACROBLOCK_SIZE>(plane, i,
+                    std::min(DCT_RUN_BLOCKS, plane.numBlocks - i), quantTables[quantTableOf(chan)],
+                    options.dctKernel, options.rdo);
+            }
+        }
+        dctStats.stop();
+
+        log(0, "DPCM()...\n");
+        dpcmStats.start();
+        DPCM(*imageBlocks, prevDc);
+        dpcmStats.stop();
+
+        log(0, "RLE()...\n");
+        rleStats.start();
+        encodedBlocks.clear();
+        for (int i = 0; i < imageBlocks->numCodedBlocks(); i++) {
+            encodedBlocks.push_back(RLE<T>(imageBlocks->codedBlock(i), MACROBLOCK_SIZE, arenas.local()));
+        }
+        rleStats.stop();
+        arenaBytes = std::max(arenaBytes, arenas.bytesAllocated());
 
-    log(0, "quantize()...\n");
-    double quantizeStartTime = CycleTimer::currentSeconds();
-    std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> quantizedBlocks;
-    for (auto dct : dcts) {
-        quantizedBlocks.push_back(quantize(dct, MACROBLOCK_SIZE, true));
-    }
-    double quantizeEndTime = CycleTimer::currentSeconds();
-
-    log(0, "DPCM()...\n");
-    double dpcmStartTime = CycleTimer::currentSeconds();
-    DPCM(quantizedBlocks);
-    double dpcmEndTime = CycleTimer::currentSeconds();
-
-    log(0, "RLE()...\n");
-    double rleStartTime = CycleTimer::currentSeconds();
-    std::vector<std::shared_ptr<EncodedBlock>> encodedBlocks;
-    for (auto quantizedBlock : quantizedBlocks) {
-        encodedBlocks.push_back(RLE(quantizedBlock, MACROBLOCK_SIZE));
+        log(0, "writing band to file...\n");
+        writeStats.start();
+        for (const auto &block : encodedBlocks) {
+            writeEncodedBlock(jpegFile, *block);
+        }
+        jpegFile.flush();
+        writeStats.stop();
+        if (firstMcu == 0) {
+            firstOutputTime = CycleTimer::currentSeconds() - startTime;
+        }
+        // the band is on disk, so its encoded blocks can go
+        arenas.release();
     }
-    double rleEndTime = CycleTimer::currentSeconds();
+    // every band is encoded, so the input can go
+    pixels = PixelImage();
 
+    size_t compressedBytes = jpegFile.tellp();
+    jpegFile.close();
     log(0, "done encoding!\n");
-    log(0, "writing to file...\n");
-    double writeCompressedImageStartTime = CycleTimer::currentSeconds();
-    std::ofstream jpegFile(compressedFile);
-    for (const auto &block : encodedBlocks) {
-        jpegFile << block;
-    }
-    double writeCompressedImageEndTime = CycleTimer::currentSeconds();
     log(0, "jpeg stored!\n");
 
-    std::shared_ptr<JpegEncoded> result = std::make_shared<JpegEncoded>();
-    result->encodedBlocks = encodedBlocks;
-    result->width = width;
-    result->height = height;
-
     double endTime = CycleTimer::currentSeconds();
+    size_t peakBytes = std::max({loadImageStats.peakBytes, convertStats.peakBytes, rateStats.peakBytes, dctStats.peakBytes,
+        dpcmStats.peakBytes, rleStats.peakBytes, writeStats.peakBytes});
 
     fprintf(stdout,
     "=======================================\n"
-    "= Sequential encoding performance: \n"
+    "= Sequential encoding performance (%s, %s DCT): \n"
     "=======================================\n"
-    "Load Image: %.3fs\n"
-    "Convert Bytes to Image: %.3fs\n"
-    "Convert RGB to YCbCr: %.3fs\n"
-    "Convert YCbCr to Blocks: %.3fs\n"
-    "DCT: %.3fs\n"
-    "Quantize: %.3fs\n"
-    "DPCM: %.3fs\n"
-    "RLE: %.3fs\n"
-    "Encode Compressed Image: %.3fs\n"
-    "Total time: %.3fs\n",
-    loadImageStopTime - loadImageStartTime,
-    convertBytesToImageEndTime - convertBytesToImageStartTime,
-    convertRgbToYcbcrEndTime - convertRgbToYcbcrStartTime,
-    convertYcbcrToBlocksEndTime - convertYcbcrToBlocksStartTime,
-    dctEndTime - dctStartTime,
-    quantizeEndTime - quantizeStartTime,
-    dpcmEndTime - dpcmStartTime,
-    rleEndTime - rleStartTime,
-    writeCompressedImageEndTime - writeCompressedImageStartTime,
-    endTime - startTime);
-
-    return result;
+    "Load Image: %.3fs, peak %.1f MB\n"
+    "Components: %s%s\n"
+    "Quality: %d%s\n"
+    "Convert Bytes to Blocks: %.3fs, peak %.1f MB\n"
+    "DCT + Quantize: %.3fs, peak %.1f MB, DCT error vs reference %.1e\n"
+    "Uniform blocks (DC only): %d of %d\n"
+    "DPCM: %.3fs, peak %.1f MB\n"
+    "RLE: %.3fs, peak %.1f MB, arenas %.1f MB\n"
+    "Encode Compressed Image: %.3fs, peak %.1f MB\n"
+    "Total time: %.3fs\n"
+    "First output: %.3fs\n"
+    "Peak memory: %.1f MB\n"
+    "Bands: %d of %d MCUs\n"
+    "Compressed size: %zu bytes\n",
+    sampleTypeName<T>(), dctImplementationName(options.dctKernel),
+    loadImageStats.seconds, loadImageStats.peakMb(),
+    all ? "YCbCr " : "Y (grayscale)", all ? chromaSubsamplingName(subsampling) : "",
+    quality, options.rdo ? ", RD-optimized quantization" : "",
+    convertStats.seconds, convertStats.peakMb(),
+    dctStats.seconds, dctStats.peakMb(), dctReferenceError<MACROBLOCK_SIZE>(options.dctKernel, DCT_CHECK_BLOCKS),
+    uniformBlocks, numBlocks,
+    dpcmStats.seconds, dpcmStats.peakMb(),
+    rleStats.seconds, rleStats.peakMb(), arenaBytes / BYTES_PER_MB,
+    writeStats.seconds, writeStats.peakMb(),
+    endTime - startTime,
+    firstOutputTime,
+    peakBytes / BYTES_PER_MB,
+    (numMcus + mcusPerBand - 1) / mcusPerBand, mcusPerBand,
+    compressedBytes);
+    if (options.targetBytes) {
+        fprintf(stdout, "Rate control: %.3fs, peak %.1f MB, quality %d estimated at %zu bytes for a target of %zu\n",
+            rateStats.seconds, rateStats.peakMb(), quality, estimatedBytes, options.targetBytes);
+    }
+    if (options.memBudget && peakBytes > options.memBudget) {
+        fprintf(stderr, "warning: peak memory %.1f MB is over the %.1f MB budget\n",
+            peakBytes / BYTES_PER_MB, options.memBudget / BYTES_PER_MB);
+    }
 }
 
-std::vector<unsigned char> jpegDecodeSeq(std::shared_ptr<JpegEncoded> jpegEncoded, const char* outfile) {
+template <typename T>
+std::vector<unsigned char> jpegDecodeSeq(const char* compressedFile, const char* outfile, DctKernel kernel, int scale) {
+
+    unsigned int width, height;
+    int components;
+    ChromaSubsampling subsampling;
+    std::ifstream jpegFile(compressedFile, std::ios::binary);
+    QuantMatrix matrices[NUM_QUANT_TABLES];
+    if (!readHeader(jpegFile, width, height, components, subsampling, matrices)) {
+        std::cout << "could not read " << compressedFile << std::endl;
+        return std::vector<unsigned char>();
+    }
 
-    unsigned int width = jpegEncoded->width;
-    unsigned int height = jpegEncoded->height;
-    std::vector<std::shared_ptr<EncodedBlock>> encodedBlocks = jpegEncoded->encodedBlocks;
+    // each intermediate is released as soon as the next stage has consumed it
 
     log(0, "==============\n");
     log(0, "now let's undo the process...\n");
 
     log(0, "undoing RLE()...\n");
-    std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> decodedQuantizedBlocks;
-    for (auto encodedBlock : encodedBlocks) {
-        decodedQuantizedBlocks.push_back(decodeRLE(encodedBlock, MACROBLOCK_SIZE));
+    // blocks are read back one at a time into the same encoded block
+    Arena arena;
+    EncodedBlockColor* encodedBlock = arena.create<EncodedBlockColor>(&arena);
+    std::shared_ptr<ImageBlocks<T>> decodedBlocks = allocateImageBlocks<T>(width, height, MACROBLOCK_SIZE, components, subsampling);
+    for (int i = 0; i < decodedBlocks->numCodedBlocks(); i++) {
+        if (!readEncodedBlock(jpegFile, *encodedBlock)) {
+            std::cout << compressedFile << " is truncated at block " << i << std::endl;
+            return std::vector<unsigned char>();
+        }
+        decodedBlocks->codedExtent(i) = decodeRLE<T>(*encodedBlock, decodedBlocks->codedBlock(i), MACROBLOCK_SIZE);
+        if (decodedBlocks->codedExtent(i) == 0) {
+            std::cout << compressedFile << " is corrupt at block " << i << std::endl;
+            return std::vector<unsigned char>();
+        }
     }
 
     log(0, "undoing DPCM()...\n");
-    unDPCM(decodedQuantizedBlocks);
+    unDPCM(*decodedBlocks);
+
+    // a reduced size decode runs the scaled matrix IDCT on orthonormal
+    // coefficients, whatever kernel encoded them
+    DctKernel idctKernel = scale > 1 ? DCT_MATRIX : kernel;
 
     log(0, "undoing quantize()...\n");
-    std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> unquantizedBlocks;
-    for (auto decodedQuantizedBlock : decodedQuantizedBlocks) {
-        unquantizedBlocks.push_back(unquantize(decodedQuantizedBlock, MACROBLOCK_SIZE, true));
+    // by the tables the encoder quantized with
+    QuantTable<MACROBLOCK_SIZE> quantTables[NUM_QUANT_TABLES] = {matrices[QUANT_LUMA], matrices[QUANT_CHROMA]};
+    for (int chan = 0; chan < components; chan++) {
+        BlockPlane<T>& plane = decodedBlocks->component(chan);
+        Span<T> blocks = plane.blocks(0, plane.numBlocks);
+        unquantize<T, MACROBLOCK_SIZE>(blocks, blocks, quantTables[quantTableOf(chan)], idctKernel);
     }
 
     log(0, "undoing DCT()...\n");
-    std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> idcts;
-    for (auto unquantized : unquantizedBlocks) {
-        idcts.push_back(IDCT(unquantized, MACROBLOCK_SIZE, true));
+    double idctStartTime = CycleTimer::currentSeconds();
+    // every plane has its own block grid, so at a reduced size chroma
+    // scales down with luma
+    // each block takes the narrowest transform its coefficients allow
+    int shapes[NUM_IDCT_SHAPES] = {0};
+    for (int chan = 0; chan < components; chan++) {
+        BlockPlane<T>& plane = decodedBlocks->component(chan);
+        for (int i = 0; i < plane.numBlocks; i += DCT_RUN_BLOCKS) {
+            idctBlocks<T, MACROBLOCK_SIZE>(plane, i, std::min(DCT_RUN_BLOCKS, plane.numBlocks - i),
+                idctKernel, scale, shapes);
+        }
     }
+    fprintf(stdout, "IDCT (%s, 1/%d scale): %.3fs, blocks %s %d, %s %d, %s %d, %s %d\n",
+        dctImplementationName(idctKernel), scale, CycleTimer::currentSeconds() - idctStartTime,
+        idctShapeName(IDCT_DC_ONLY), shapes[IDCT_DC_ONLY], idctShapeName(IDCT_2X2), shapes[IDCT_2X2],
+        idctShapeName(IDCT_4X4), shapes[IDCT_4X4], idctShapeName(IDCT_FULL), shapes[IDCT_FULL]);
 
-    log(0, "undoing convertYcbcrToBlocks()...\n");
-    std::shared_ptr<ImageBlocks> imageBlocksIdct(new ImageBlocks);
-    imageBlocksIdct->blocks = idcts;
-    imageBlocksIdct->width = width;
-    imageBlocksIdct->height = height;
-    std::shared_ptr<ImageYcbcr> imgFromBlocks = convertBlocksToYcbcr(imageBlocksIdct, MACROBLOCK_SIZE);
+    log(0, "convertBlocksToYcbcr()...\n");
+    std::shared_ptr<ImageYcbcr<T>> imgFromBlocks = convertBlocksToYcbcr(decodedBlocks, MACROBLOCK_SIZE, scale);
+    decodedBlocks.reset();
 
-    log(0, "undoing convertRgbToYcbcr()...\n");
+    log(0, "convertYcbcrToRgb()...\n");
     std::shared_ptr<ImageRgb> imageRgbRecovered = convertYcbcrToRgb(imgFromBlocks);
+    imgFromBlocks.reset();
 
-    log(0, "undoing convertBytesToImage()...\n");
+    log(0, "convertImageToBytes()...\n");
     std::vector<unsigned char> imgRecovered = convertImageToBytes(imageRgbRecovered);
+    imageRgbRecovered.reset();
 
-    unsigned int error = lodepng::encode(outfile, imgRecovered, width, height);
+    unsigned int error = lodepng::encode(outfile, imgRecovered, (width + scale - 1) / scale, (height + scale - 1) / scale);
 
     if(error) {
         std::cout << "encoder error " << error << ": "<< lodepng_error_text(error) << std::endl;
@@ -192,15 +305,27 @@ std::vector<unsigned char> jpegDecodeSeq(std::shared_ptr<JpegEncoded> jpegEncode
     return imgRecovered;
 }
 
-void encodeSeq(const char* infile, const char* outfile, const char* compressedFile) {
+template <typename T>
+void encodeSeq(const char* infile, const char* outfile, const char* compressedFile, const EncodeOptions& options) {
+
+    jpegSeq<T>(infile, compressedFile, options);
+    std::vector<unsigned char> imgRecovered = jpegDecodeSeq<T>(compressedFile, outfile, options.dctKernel, options.decodeScale);
 
-    std::shared_ptr<JpegEncoded> jpegEncoded = jpegSeq(infile, compressedFile);
-    std::vector<std::shared_ptr<EncodedBlock>> encodedBlocks = jpegEncoded->encodedBlocks;
-    std::vector<unsigned char> imgRecovered = jpegDecodeSeq(jpegEncoded, outfile);
+    // Report the quality of the recovered image against the input, if it
+    // was decoded at full size
+    PixelImage pixels;
+    if (!imgRecovered.empty() && options.decodeScale == 1 && !decodePng(pixels, infile)) {
+        fprintf(stdout, "PSNR: %.3f dB\n", computePsnr(pixels, imgRecovered));
+    }
 
 }
 
-void encodeMpi(const char* infile, const char* outfile, const char* compressedFile) {
+// MPI datatype of a Coefficient
+static_assert(sizeof(Coefficient) == sizeof(short), "MPI_SHORT doesn't hold a Coefficient");
+#define MPI_COEFFICIENT MPI_SHORT
+
+template <typename T>
+void encodeMpi(const char* infile, const char* outfile, const char* compressedFile, const EncodeOptions& options) {
 
     // Start parallel area
     MPI_Status mpiStatus;
@@ -211,14 +336,21 @@ void encodeMpi(const char* infile, const char* outfile, const char* compressedFi
 
     double endTime = CycleTimer::currentSeconds();
 
-    log(rank, "running MPI version\n");
+    log(rank, "running MPI version (%s)\n", sampleTypeName<T>());
     double startTime = CycleTimer::currentSeconds();
-    std::vector<unsigned char> bytes; // The raw pixels
+    PixelImage pixels; // The raw pixels, in the PNG's own layout
     unsigned int width, height;
-
-    double loadImageStartTime = CycleTimer::currentSeconds();
-    unsigned int error = lodepng::decode(bytes, width, height, infile);
-    double loadImageEndTime = CycleTimer::currentSeconds();
+    StageStats loadImageStats, convertStats, rateStats, dctStats, dpcmStats, rleStats, gatherStats, writeStats;
+
+    loadImageStats.start();
+    unsigned int error = decodePng(pixels, infile);
+    // every rank sees the same pixels, so all agree whether to drop chroma
+    int components = isGrayscale(pixels) ? 1 : NUM_COMPONENTS;
+    bool all = components == NUM_COMPONENTS;
+    ChromaSubsampling subsampling = all ? options.chromaSubsampling : CHROMA_444;
+    loadImageStats.stop();
+    width = pixels.width;
+    height = pixels.height;
 
     if(error) {
         std::cout << "decoder error " << error << ": " << lodepng_error_text(error) << std::endl;
@@ -230,438 +362,346 @@ void encodeMpi(const char* infile, const char* outfile, const char* compressedFi
 
     // Begin setup MPI structs
     double mpiSetupStartTime = CycleTimer::currentSeconds();
-    // set up mpi pixelycbcr
-    // float y, cb, cr
-    MPI_Datatype MPI_PixelYcbcr;
-    MPI_Type_contiguous(3, MPI_DOUBLE, &MPI_PixelYcbcr);
-    MPI_Type_commit(&MPI_PixelYcbcr);
-
     // Set up RleTuple datatype
     MPI_Datatype MPI_RleTuple;
-    MPI_Type_contiguous(2, MPI_CHAR, &MPI_RleTuple);
+    MPI_Type_contiguous(sizeof(RleTuple), MPI_UNSIGNED_CHAR, &MPI_RleTuple);
     MPI_Type_commit(&MPI_RleTuple);
 
     // Set up EncodedBlockColor
-    // Change to data structure: convert std::vector to {char size, [RleTuple]}
+    // Change to data structure: convert std::vector to {RleCode size, [RleTuple]}
     // Change to data stucture: convert std::map to
-    //      {char num_entries, [char], [double]}
+    //      {RleCode num_entries, [RleCode], [Coefficient]}
     // New struct:
-    //      - double dc_val
-    //      - char encoded_len
+    //      - Coefficient dc_val
+    //      - RleCode encoded_len
     //      - rleTupleVector encoded
-    //      - char table_size
-    //      - charVector char_vals
-    //      - doubleVector double_vals
+    //      - RleCode table_size
+    //      - codeVector char_vals
+    //      - coeffVector coeff_vals
 
     // 1. Set up encoded[RleTuple]
     MPI_Datatype MPI_RleTupleVector;
-    MPI_Type_contiguous(MACROBLOCK_SIZE * MACROBLOCK_SIZE, MPI_RleTuple, &MPI_RleTupleVector);
+    MPI_Type_contiguous(MACROBLOCK_PIXELS, MPI_RleTuple, &MPI_RleTupleVector);
     MPI_Type_commit(&MPI_RleTupleVector);
 
-    // 2. Set up vector for map: char values
+    // 2. Set up vector for map: symbols
     MPI_Datatype MPI_CharVector;
-    MPI_Type_contiguous(MACROBLOCK_SIZE * MACROBLOCK_SIZE, MPI_CHAR, &MPI_CharVector);
+    MPI_Type_contiguous(MACROBLOCK_PIXELS, MPI_UNSIGNED_CHAR, &MPI_CharVector);
     MPI_Type_commit(&MPI_CharVector);
 
-    // 3. Set up vector for map: double values
-    MPI_Datatype MPI_DoubleVector;
-    MPI_Type_contiguous(MACROBLOCK_SIZE * MACROBLOCK_SIZE, MPI_DOUBLE, &MPI_DoubleVector);
-    MPI_Type_commit(&MPI_DoubleVector);
+    // 3. Set up vector for map: coefficient values
+    MPI_Datatype MPI_CoeffVector;
+    MPI_Type_contiguous(MACROBLOCK_PIXELS, MPI_COEFFICIENT, &MPI_CoeffVector);
+    MPI_Type_commit(&MPI_CoeffVector);
 
-    // 4. Set up structure for EncodedBlockColor
+    // 4. Set up structure for EncodedBlockColor, laid out as the compiler
+    // lays out EncodedBlockColorNoPtr
     int encodedBlockColorLen = 6;
-    MPI_Datatype MPI_EncodedBlockColor, encodedBlockColorTypes[encodedBlockColorLen];
+    MPI_Datatype MPI_EncodedBlockColorFields, MPI_EncodedBlockColor, encodedBlockColorTypes[encodedBlockColorLen];
     int encodedBlockColorBlocks[encodedBlockColorLen];
-    MPI_Aint encodedBlockColorOffsets[encodedBlockColorLen], lb, extent;
-    // double dc_val
-    encodedBlockColorOffsets[0] = 0;
-    encodedBlockColorTypes[0] = MPI_DOUBLE;
+    MPI_Aint encodedBlockColorOffsets[encodedBlockColorLen];
+    // Coefficient dc_val
+    encodedBlockColorOffsets[0] = offsetof(EncodedBlockColorNoPtr, dc_val);
+    encodedBlockColorTypes[0] = MPI_COEFFICIENT;
     encodedBlockColorBlocks[0] = 1;
-    // char encoded_len
-    MPI_Type_get_extent(MPI_DOUBLE, &lb, &extent);
-    encodedBlockColorOffsets[1] = encodedBlockColorOffsets[0] + extent;
-    encodedBlockColorTypes[1] = MPI_CHAR;
+    // RleCode encoded_len
+    encodedBlockColorOffsets[1] = offsetof(EncodedBlockColorNoPtr, encoded_len);
+    encodedBlockColorTypes[1] = MPI_UNSIGNED_CHAR;
     encodedBlockColorBlocks[1] = 1;
     // rleTupleVector encoded
-    MPI_Type_get_extent(MPI_CHAR, &lb, &extent);
-    encodedBlockColorOffsets[2] = encodedBlockColorOffsets[1] + extent;
+    encodedBlockColorOffsets[2] = offsetof(EncodedBlockColorNoPtr, encoded);
     encodedBlockColorTypes[2] = MPI_RleTupleVector;
     encodedBlockColorBlocks[2] = 1;
-    // char table_size
-    MPI_Type_get_extent(MPI_RleTupleVector, &lb, &extent);
-    encodedBlockColorOffsets[3] = encodedBlockColorOffsets[2] + extent;
-    encodedBlockColorTypes[3] = MPI_CHAR;
+    // RleCode table_size
+    encodedBlockColorOffsets[3] = offsetof(EncodedBlockColorNoPtr, table_size);
+    encodedBlockColorTypes[3] = MPI_UNSIGNED_CHAR;
     encodedBlockColorBlocks[3] = 1;
-    // charVector char_vals
-    MPI_Type_get_extent(MPI_CHAR, &lb, &extent);
-    encodedBlockColorOffsets[4] = encodedBlockColorOffsets[3] + extent;
+    // codeVector char_vals
+    encodedBlockColorOffsets[4] = offsetof(EncodedBlockColorNoPtr, char_vals);
     encodedBlockColorTypes[4] = MPI_CharVector;
     encodedBlockColorBlocks[4] = 1;
-    // doubleVector double_vals
-    MPI_Type_get_extent(MPI_CharVector, &lb, &extent);
-    encodedBlockColorOffsets[5] = encodedBlockColorOffsets[4] + extent;
-    encodedBlockColorTypes[5] = MPI_DoubleVector;
+    // coeffVector coeff_vals
+    encodedBlockColorOffsets[5] = offsetof(EncodedBlockColorNoPtr, coeff_vals);
+    encodedBlockColorTypes[5] = MPI_CoeffVector;
     encodedBlockColorBlocks[5] = 1;
     MPI_Type_create_struct(encodedBlockColorLen, encodedBlockColorBlocks,
-        encodedBlockColorOffsets, encodedBlockColorTypes, &MPI_EncodedBlockColor);
+        encodedBlockColorOffsets, encodedBlockColorTypes, &MPI_EncodedBlockColorFields);
+    MPI_Type_create_resized(MPI_EncodedBlockColorFields, 0, sizeof(EncodedBlockColorNoPtr), &MPI_EncodedBlockColor);
     MPI_Type_commit(&MPI_EncodedBlockColor);
-
-    // Set up EncodedBlock
-    // Change to struct: change it to array of EncodedBlockColor[3] instead
-    //      of y, cr, cb fields
-    MPI_Datatype MPI_EncodedBlock;
-    MPI_Type_contiguous(3, MPI_EncodedBlockColor, &MPI_EncodedBlock);
-    MPI_Type_commit(&MPI_EncodedBlock);
+    MPI_Type_free(&MPI_EncodedBlockColorFields);
+    // blocks of every component are sent alike, in coding order
     double mpiSetupEndTime = CycleTimer::currentSeconds();
     // End setup for MPI Structs
 
     int tag = 1;
 
     /*
-     * BEGIN SCATTER
-     * Purpose: give each thread a section of bytes to convert to an image
+     * Every thread has decoded the whole PNG, so each one converts its own
+     * contiguous range of MCUs straight from the decoded pixels; no pixels or
+     * blocks have to be scattered or gathered.
      */
-
-    log(rank, "SCATTER\n");
-    log(rank, "convertBytesToImage()...\n");
-    double convertBytesToImageStartTime = CycleTimer::currentSeconds();
-    int numPixels = bytes.size() / 4;
-    int len = numPixels / numTasks;
-    int start = rank * len * 4;
-    int end = (rank + 1) * len * 4;
+    McuGrid grid = mcuGrid(width, height, MACROBLOCK_SIZE, subsampling);
+    int numMcus = grid.numMcus;
+    int mcusPerTask = numMcus / numTasks;
+    int firstWorkerMcu = rank * mcusPerTask;
     // handle rounding issues
-    if (rank == numTasks - 1) {
-        end = bytes.size();
+    int numWorkerMcus = (rank == numTasks - 1) ? numMcus - firstWorkerMcu : mcusPerTask;
+    int endWorkerMcu = firstWorkerMcu + numWorkerMcus;
+
+    // the range is encoded in bands of whole MCU rows to stay within the
+    // memory budget; without one the range is a single band
+    int mcusPerBand = bandMcus(pixels, MACROBLOCK_SIZE, options.bandRows, sizeof(T), options.memBudget, components, subsampling);
+    // With a target size, each thread transforms its range once, and every
+    // one searches the same totals of their estimates for the highest
+    // quality that fits it; only that quality is encoded. Within a memory
+    // budget each estimate transforms the range again band by band.
+    int quality = options.quality;
+    size_t estimatedBytes = 0;
+    if (options.targetBytes) {
+        log(rank, "rate control...\n");
+        rateStats.start();
+        std::shared_ptr<ImageBlocks<T>> coefficients;
+        if (!options.memBudget) {
+            coefficients = rateControlBlocks<T>(pixels, firstWorkerMcu, numWorkerMcus, components, subsampling,
+                                                options.dctKernel);
+        }
+        std::function<size_t(int)> estimate = [&](int q) {
+            unsigned long long rangeBytes = coefficients ? estimateEncodedBytes(*coefficients, q, options.dctKernel)
+                : estimateBandedBytes<T>(pixels, firstWorkerMcu, numWorkerMcus, mcusPerBand, components, subsampling, q,
+                                         options.dctKernel);
+            unsigned long long totalBytes = 0;
+            MPI_Allreduce(&rangeBytes, &totalBytes, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+            return headerBytes(components) + (size_t) totalBytes;
+        };
+        quality = searchQuality(options.targetBytes, estimate);
+        estimatedBytes = estimate(quality);
+        rateStats.stop();
     }
-    std::shared_ptr<ImageRgb> imageRgb = convertBytesToImage(bytes, width, height, start, end);
-    double convertBytesToImageEndTime = CycleTimer::currentSeconds();
-
-    // each thread will continue and convert its image to ycbcr
-    log(rank, "convertRgbToYcbcr()...\n");
-    double convertRgbToYcbcrStartTime = CycleTimer::currentSeconds();
-    std::shared_ptr<ImageYcbcr> imageYcbcr = convertRgbToYcbcr(imageRgb);
-    double convertRgbToYcbcrEndTime = CycleTimer::currentSeconds();
-
-    /*
-     * BEGIN GATHER
-     * Purpose: collect all images into the full image in master
-     */
-    log(rank, "GATHER\n");
-    double gatherYcbcrPixelsStartTime = CycleTimer::currentSeconds();
-    if (rank == 0) {
-        for (int i = 1; i < numTasks; i++) {
-            start = i * len;
-            end = (i + 1) * len;
-            // handle rounding issues
-            if (i == numTasks - 1) {
-                end = bytes.size();
-            }
-            // receive image metadata
-            MPI_Recv(&numPixels, 1, MPI_INT, i, MPI_ANY_TAG, MPI_COMM_WORLD, &mpiStatus);
-            // receive image pixels
-            std::shared_ptr<PixelYcbcr> buffer(new PixelYcbcr[numPixels]);
-            MPI_Recv(buffer.get(), numPixels, MPI_PixelYcbcr, i, MPI_ANY_TAG, MPI_COMM_WORLD, &mpiStatus);
-            // add pixels to full image
-            for (int j = 0; j < numPixels; j++) {
-                std::shared_ptr<PixelYcbcr> pixel(new PixelYcbcr());
-                pixel->y = (buffer.get())[j].y;
-                pixel->cb = (buffer.get())[j].cb;
-                pixel->cr = (buffer.get())[j].cr;
-                imageYcbcr->pixels.push_back(pixel);
-                imageYcbcr->numPixels++;
+    // the tables are scaled to the quality once, and carried in the file
+    // for the decoder
+    QuantMatrix matrices[NUM_QUANT_TABLES] = {scaledQuantMatrix(QUANT_LUMA, quality),
+                                              scaledQuantMatrix(QUANT_CHROMA, quality)};
+    QuantTable<MACROBLOCK_SIZE> quantTables[NUM_QUANT_TABLES] = {matrices[QUANT_LUMA], matrices[QUANT_CHROMA]};
+    // encoded blocks of every rank, and those received by master, live here
+    ArenaPool arenas;
+    // most bytes the arenas held at once, for the RLE report
+    size_t arenaBytes = 0;
+    std::vector<EncodedBlockColor*> encodedBlocks;
+    // DC values are coded continuously across the bands of this range
+    Coefficient prevDc[3] = {0, 0, 0};
+    // blocks of this range that skipped the DCT, being uniform
+    int uniformBlocks = 0;
+    for (int firstMcu = firstWorkerMcu; firstMcu < endWorkerMcu; firstMcu += mcusPerBand) {
+        int numBandMcus = std::min(mcusPerBand, endWorkerMcu - firstMcu);
+
+        log(rank, "convertBytesToBlocks()...\n");
+        convertStats.start();
+        std::shared_ptr<ImageBlocks<T>> imageBlocksWorker = convertBytesToBlocks<T>(pixels, MACROBLOCK_SIZE, firstMcu, numBandMcus, components, subsampling);
+        convertStats.stop();
+
+        // blocks stay in their threads
+        // each block is quantized as it is transformed, in one pass, a run
+        // of blocks of a component at a time; uniform blocks skip the
+        // transform
+        log(rank, "dctQuantize()...\n");
+        dctStats.start();
+        for (int chan = 0; chan < components; chan++) {
+            BlockPlane<T>& plane = imageBlocksWorker->component(chan);
+            for (int i = 0; i < plane.numBlocks; i += DCT_RUN_BLOCKS) {
+                uniformBlocks += dctQuantizeBlocks<T, MACROBLOCK_SIZE>(plane, i,
+                    std::min(DCT_RUN_BLOCKS, plane.numBlocks - i), quantTables[quantTableOf(chan)],
+                    options.dctKernel, options.rdo);
             }
         }
-    } else {
-        MPI_Send(&(imageYcbcr->numPixels), 1, MPI_INT, 0, tag, MPI_COMM_WORLD);
-        std::shared_ptr<PixelYcbcr> buffer(new PixelYcbcr[imageYcbcr->numPixels]);
-        for (int i = 0; i < imageYcbcr->numPixels; i++) {
-            (buffer.get())[i].y = imageYcbcr->pixels[i]->y;
-            (buffer.get())[i].cb = imageYcbcr->pixels[i]->cb;
-            (buffer.get())[i].cr = imageYcbcr->pixels[i]->cr;
+        dctStats.stop();
+
+        // blocks stay in their threads
+        log(rank, "DPCM()...\n");
+        dpcmStats.start();
+        DPCM(*imageBlocksWorker, prevDc);
+        dpcmStats.stop();
+
+        // blocks stay in their threads
+        log(rank, "RLE()...\n");
+        rleStats.start();
+        for (int i = 0; i < imageBlocksWorker->numCodedBlocks(); i++) {
+            encodedBlocks.push_back(RLE<T>(imageBlocksWorker->codedBlock(i), MACROBLOCK_SIZE, arenas.local()));
         }
-        MPI_Send(buffer.get(), imageYcbcr->numPixels, MPI_PixelYcbcr, 0, tag, MPI_COMM_WORLD);
+        rleStats.stop();
+        arenaBytes = std::max(arenaBytes, arenas.bytesAllocated());
     }
-    double gatherYcbcrPixelsEndTime = CycleTimer::currentSeconds();
-
-    /*
-     * END GATHER
-     */
-
-    std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> imageBlocksWorker;
-
-    double convertYcbcrToBlocksStartTime = CycleTimer::currentSeconds();
-    if (rank == 0) {
-        log(rank, "convertYcbcrToBlocks()...\n");
-
-        std::shared_ptr<ImageBlocks> imageBlocks = convertYcbcrToBlocks(imageYcbcr, MACROBLOCK_SIZE);
-
-        /*
-         * BEGIN SCATTER
-         * Purpose: send blocks out to threads
-         */
-        log(rank, "SCATTER\n");
-
-        // pixels in the blocks for each thread
-        std::vector<std::shared_ptr<PixelYcbcr>> workerPixels[numTasks];
-
-        // choose blocks for each thread
-        for (unsigned int i = 0; i < imageBlocks->blocks.size(); i++) {
-            // append the pixels in the block to the running list for the thread
-            int index = i % numTasks;
-            std::vector<std::shared_ptr<PixelYcbcr>> block = imageBlocks->blocks[i];
-            workerPixels[index].insert(workerPixels[index].end(), block.begin(), block.end());
-        }
-
-        // send blocks to each thread
-        for (int i = 1; i < numTasks; i++) {
-            numPixels = workerPixels[i].size();
-            std::shared_ptr<PixelYcbcr> buffer(new PixelYcbcr[numPixels]);
-            for (int j = 0; j < numPixels; j++) {
-                (buffer.get())[j].y = workerPixels[i][j]->y;
-                (buffer.get())[j].cb = workerPixels[i][j]->cb;
-                (buffer.get())[j].cr = workerPixels[i][j]->cr;
+    // every band is encoded, so the input can go
+    pixels = PixelImage();
+
+    // the first MCU of each range is coded against the last DC values of
+    // the previous range, so pass those down the chain of threads and
+    // correct the first encoded DC value of each component
+    dpcmStats.start();
+    if (rank + 1 < numTasks) {
+        MPI_Send(prevDc, 3, MPI_COEFFICIENT, rank + 1, tag, MPI_COMM_WORLD);
+    }
+    if (rank > 0) {
+        Coefficient rangePrevDc[3];
+        MPI_Recv(rangePrevDc, 3, MPI_COEFFICIENT, rank - 1, MPI_ANY_TAG, MPI_COMM_WORLD, &mpiStatus);
+        if (!encodedBlocks.empty()) {
+            // the MCU's first luma block, then its Cr and Cb blocks
+            int luma = grid.lumaBlocksPerMcu();
+            encodedBlocks[0]->dc_val -= rangePrevDc[0];
+            if (all) {
+                encodedBlocks[luma]->dc_val -= rangePrevDc[1];
+                encodedBlocks[luma + 1]->dc_val -= rangePrevDc[2];
             }
-            MPI_Send(&numPixels, 1, MPI_INT, i, tag, MPI_COMM_WORLD);
-            MPI_Send(buffer.get(), numPixels, MPI_PixelYcbcr, i, tag, MPI_COMM_WORLD);
-        }
-
-        int pixelsPerBlock = MACROBLOCK_SIZE * MACROBLOCK_SIZE;
-        // blocks for master thread
-        std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> blocks(workerPixels[0].size() / pixelsPerBlock);
-        for (unsigned int i = 0; i < workerPixels[0].size(); i++) {
-            int index = i / pixelsPerBlock;
-            blocks[index].push_back(workerPixels[0][i]);
         }
-
-        imageBlocksWorker = blocks;
-    } else {
-        // Get number of pixels to recv from master
-        MPI_Recv(&numPixels, 1, MPI_INT, 0, MPI_ANY_TAG, MPI_COMM_WORLD, &mpiStatus);
-        std::shared_ptr<PixelYcbcr> buffer(new PixelYcbcr[numPixels]);
-        MPI_Recv(buffer.get(), numPixels, MPI_PixelYcbcr, 0, MPI_ANY_TAG, MPI_COMM_WORLD, &mpiStatus);
-
-        // pixels per block
-        int pixelsPerBlock = MACROBLOCK_SIZE * MACROBLOCK_SIZE;
-        // blocks for master thread
-        std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> blocks(numPixels / pixelsPerBlock);
-        for (int i = 0; i < numPixels; i++) {
-            int index = i / pixelsPerBlock;
-            std::shared_ptr<PixelYcbcr> pixel(new PixelYcbcr());
-            pixel->y = (buffer.get())[i].y;
-            pixel->cb = (buffer.get())[i].cb;
-            pixel->cr = (buffer.get())[i].cr;
-            blocks[index].push_back(pixel);
-        }
-
-        imageBlocksWorker = blocks;
     }
-    double convertYcbcrToBlocksEndTime = CycleTimer::currentSeconds();
-
-    /*
-     * END SCATTER
-     * Purpose: send blocks out to threads
-     */
+    dpcmStats.stop();
 
-    // blocks stay in their threads
-    log(rank, "DCT()...\n");
-    double dctStartTime = CycleTimer::currentSeconds();
-    std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> dcts;
-    for (auto block : imageBlocksWorker) {
-        dcts.push_back(DCT(block, MACROBLOCK_SIZE, true));
-    }
-    double dctEndTime = CycleTimer::currentSeconds();
-
-    // blocks stay in their threads
-    log(rank, "quantize()...\n");
-    double quantizeStartTime = CycleTimer::currentSeconds();
-    std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> quantizedBlocks;
-    for (auto dct : dcts) {
-        quantizedBlocks.push_back(quantize(dct, MACROBLOCK_SIZE, true));
-    }
-    double quantizeEndTime = CycleTimer::currentSeconds();
-
-    // blocks stay in their threads
-    log(rank, "DPCM()...\n");
-    double dpcmStartTime = CycleTimer::currentSeconds();
-    DPCM(quantizedBlocks);
-    double dpcmEndTime = CycleTimer::currentSeconds();
-
-    // blocks stay in their threads
-    log(rank, "RLE()...\n");
-    double encodedBlocksStartTime = CycleTimer::currentSeconds();
-    std::vector<std::shared_ptr<EncodedBlock>> encodedBlocks;
-    for (auto quantizedBlock : quantizedBlocks) {
-        encodedBlocks.push_back(RLE(quantizedBlock, MACROBLOCK_SIZE));
-    }
-    double encodedBlocksEndTime = CycleTimer::currentSeconds();
+    // master reports the uniform blocks of the whole image
+    int totalUniformBlocks = 0;
+    MPI_Reduce(&uniformBlocks, &totalUniformBlocks, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
 
     /*
      * BEGIN GATHER
-     * Purpose: collect all blocks back into a vector of encoded blocks in master
+     * Purpose: collect all blocks in master, which appends each thread's
+     * range to the compressed file in order as it arrives
      */
     log(rank, "GATHER\n");
-    double gatherEncodedBlocksStartTime = CycleTimer::currentSeconds();
-    // For master thread, collect encoded blocks in order from workers
     int numEncodedBlocks;
-    // encoded blocks for all threads
-    std::vector<std::shared_ptr<EncodedBlock>> allEncodedBlocks[numTasks];
-    // encoded blocks in original order
-    std::vector<std::shared_ptr<EncodedBlock>> finalEncodedBlocks;
+    size_t compressedBytes = 0;
     if (rank == 0) {
-        allEncodedBlocks[0] = encodedBlocks;
+        writeStats.start();
+        std::ofstream jpegFile(compressedFile, std::ios::binary);
+        writeHeader(jpegFile, width, height, components, subsampling, matrices);
+        for (const auto &block : encodedBlocks) {
+            writeEncodedBlock(jpegFile, *block);
+        }
+        encodedBlocks.clear();
+        arenas.release();
+        writeStats.stop();
         // grab all encoded blocks from workers
         for (int i = 1; i < numTasks; i++) {
+            gatherStats.start();
             // recv the number of encoded blocks
             MPI_Recv(&numEncodedBlocks, 1, MPI_INT, i, MPI_ANY_TAG, MPI_COMM_WORLD, &mpiStatus);
             // recv the encoded blocks
-            std::shared_ptr<EncodedBlockNoPtr> encodedBlocksBuffer(new EncodedBlockNoPtr[numEncodedBlocks]);
-            MPI_Recv(encodedBlocksBuffer.get(), numEncodedBlocks, MPI_EncodedBlock, i, MPI_ANY_TAG, MPI_COMM_WORLD, &mpiStatus);
-            std::vector<std::shared_ptr<EncodedBlock>> encodedBlocksRecv = convertBufferToEncodedBlocks(encodedBlocksBuffer, numEncodedBlocks);
-            std::vector<std::shared_ptr<EncodedBlock>> threadEncodedBlocks;
-            for (int j = 0; j < numEncodedBlocks; j++) {
-                threadEncodedBlocks.push_back(encodedBlocksRecv[j]);
+            std::shared_ptr<EncodedBlockColorNoPtr> encodedBlocksBuffer(new EncodedBlockColorNoPtr[numEncodedBlocks]);
+            MPI_Recv(encodedBlocksBuffer.get(), numEncodedBlocks, MPI_EncodedBlockColor, i, MPI_ANY_TAG, MPI_COMM_WORLD, &mpiStatus);
+            std::vector<EncodedBlockColor*> encodedBlocksRecv = convertBufferToEncodedBlocks(encodedBlocksBuffer, numEncodedBlocks, arenas.local());
+            encodedBlocksBuffer.reset();
+            gatherStats.stop();
+            // ranges arrive in original order, so append this one
+            writeStats.start();
+            for (const auto &block : encodedBlocksRecv) {
+                writeEncodedBlock(jpegFile, *block);
             }
-            allEncodedBlocks[i] = threadEncodedBlocks;
-        }
-        // find number of total encoded blocks
-        int totalEncodedBlocks = 0;
-        int indices[numTasks];
-        for (int i = 0; i < numTasks; i++) {
-            totalEncodedBlocks += allEncodedBlocks[i].size();
-            indices[i] = 0;
-        }
-        // reorder encoded blocks by original order
-        for (int i = 0; i < totalEncodedBlocks; i++) {
-            int index = i % numTasks;
-            finalEncodedBlocks.push_back(allEncodedBlocks[index][indices[index]]);
-            indices[index]++;
+            arenas.release();
+            writeStats.stop();
         }
+        compressedBytes = jpegFile.tellp();
     } else {
         // For each worker, send its encoded blocks back to master
         numEncodedBlocks = encodedBlocks.size();
         // Send number of encoded blocks
         MPI_Send(&numEncodedBlocks, 1, MPI_INT, 0, tag, MPI_COMM_WORLD);
-        std::shared_ptr<EncodedBlockNoPtr> encodedBlockBuffer(new EncodedBlockNoPtr[numEncodedBlocks]);
+        std::shared_ptr<EncodedBlockColorNoPtr> encodedBlockBuffer(new EncodedBlockColorNoPtr[numEncodedBlocks]);
         // Build the encoded blocks structure
         for (unsigned int i = 0; i < encodedBlocks.size(); i++) {
-            writeToBuffer(encodedBlockBuffer, encodedBlocks, i, COLOR_Y);
-            writeToBuffer(encodedBlockBuffer, encodedBlocks, i, COLOR_CR);
-            writeToBuffer(encodedBlockBuffer, encodedBlocks, i, COLOR_CB);
+            writeToBuffer(encodedBlockBuffer, encodedBlocks, i);
         }
         // Send the encoded blocks
-        MPI_Send(encodedBlockBuffer.get(), numEncodedBlocks, MPI_EncodedBlock, 0, tag, MPI_COMM_WORLD);
+        MPI_Send(encodedBlockBuffer.get(), numEncodedBlocks, MPI_EncodedBlockColor, 0, tag, MPI_COMM_WORLD);
         MPI_Finalize();
         return;
     }
-    double gatherEncodedBlocksEndTime = CycleTimer::currentSeconds();
 
     /*
      * END GATHER
-     * Purpose: collect all blocks back into a vector of encoded blocks in master
      */
 
-    double encodeCompressedStartTime = CycleTimer::currentSeconds();
-    if (rank == 0) {
-        log(0, "done encoding!\n");
-        log(0, "writing to file...\n");
-        std::ofstream jpegFile(compressedFile);
-        for (const auto &block : finalEncodedBlocks) {
-            jpegFile << block;
-        }
-        log(0, "jpeg stored!\n");
-        endTime = CycleTimer::currentSeconds();
-        log(0, "Time Elapsed: %.3fs\n", (endTime - startTime));
-        log(0, "==============\n");
-        log(0, "now let's undo the process...\n");
-    }
-
-    log(rank, "undoing RLE()...\n");
-    std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> decodedQuantizedBlocks;
-    for (auto encodedBlock : finalEncodedBlocks) {
-        decodedQuantizedBlocks.push_back(decodeRLE(encodedBlock, MACROBLOCK_SIZE));
-    }
-
-    log(rank, "undoing DPCM()...\n");
-    unDPCM(decodedQuantizedBlocks);
-
-    log(rank, "undoing quantize()...\n");
-    std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> unquantizedBlocks;
-    for (auto decodedQuantizedBlock : decodedQuantizedBlocks) {
-        unquantizedBlocks.push_back(unquantize(decodedQuantizedBlock, MACROBLOCK_SIZE, true));
-    }
-
-    log(rank, "undoing DCT()...\n");
-    std::vector<std::vector<std::shared_ptr<PixelYcbcr>>> idcts;
-    for (auto unquantized : unquantizedBlocks) {
-        idcts.push_back(IDCT(unquantized, MACROBLOCK_SIZE, true));
-    }
-
-    log(rank, "undoing convertYcbcrToBlocks()...\n");
-    std::shared_ptr<ImageBlocks> imageBlocksIdct(new ImageBlocks);
-    imageBlocksIdct->blocks = idcts;
-    imageBlocksIdct->width = width;
-    imageBlocksIdct->height = height;
-    std::shared_ptr<ImageYcbcr> imgFromBlocks = convertBlocksToYcbcr(imageBlocksIdct, MACROBLOCK_SIZE);
-    log(rank, "undoing convertRgbToYcbcr()...\n");
-    std::shared_ptr<ImageRgb> imageRgbRecovered = convertYcbcrToRgb(imgFromBlocks);
-
-    log(rank, "undoing convertImageToBytes()...\n");
-    std::vector<unsigned char> imgRecovered = convertImageToBytes(imageRgbRecovered);
-
-    if (rank == 0) {
-        error = lodepng::encode(outfile, imgRecovered, width, height);
+    log(0, "done encoding!\n");
+    log(0, "jpeg stored!\n");
+    endTime = CycleTimer::currentSeconds();
+    log(0, "Time Elapsed: %.3fs\n", (endTime - startTime));
+    log(0, "==============\n");
+    log(0, "now let's undo the process...\n");
 
-        if(error) {
-            std::cout << "encoder error " << error << ": "<< lodepng_error_text(error) << std::endl;
-        } else {
-            fprintf(stdout, "success encoding to %s!\n", outfile);
-        }
+    // master reads the compressed file back like any other decoder
+    std::vector<unsigned char> imgRecovered = jpegDecodeSeq<T>(compressedFile, outfile, options.dctKernel, options.decodeScale);
+    // not a number unless the recovered image can be compared
+    double psnr = NAN;
+    // the input was freed after encoding, so read it again to compare
+    if (!imgRecovered.empty() && options.decodeScale == 1 && !decodePng(pixels, infile)) {
+        psnr = computePsnr(pixels, imgRecovered);
     }
 
     // Free derived types
-    MPI_Type_free(&MPI_PixelYcbcr);
     MPI_Type_free(&MPI_RleTuple);
     MPI_Type_free(&MPI_RleTupleVector);
     MPI_Type_free(&MPI_CharVector);
-    MPI_Type_free(&MPI_DoubleVector);
+    MPI_Type_free(&MPI_CoeffVector);
     MPI_Type_free(&MPI_EncodedBlockColor);
-    MPI_Type_free(&MPI_EncodedBlock);
 
     // End parallel area
     MPI_Finalize();
 
     // Print statistics
     if (rank == 0) {
+        size_t peakBytes = std::max({loadImageStats.peakBytes, convertStats.peakBytes, rateStats.peakBytes, dctStats.peakBytes,
+            dpcmStats.peakBytes, rleStats.peakBytes, gatherStats.peakBytes, writeStats.peakBytes});
         fprintf(stdout,
         "=======================================\n"
-        "= MPI encoding performance: \n"
+        "= MPI encoding performance (%s, %s DCT): \n"
         "=======================================\n"
-        "Load image: %.3fs\n"
+        "Load image: %.3fs, peak %.1f MB\n"
+        "Components: %s%s\n"
+        "Quality: %d%s\n"
         "Setup MPI: %.3fs\n"
-        "Convert Bytes to Image: %.3fs\n"
-        "Convert RGB to YCbCr: %.3fs\n"
-        "Gather YCbCr Pixels: %.3fs\n"
-        "Convert YCbCr to Blocks: %.3fs\n"
-        "DCT: %.3fs\n"
-        "Quantize: %.3fs\n"
-        "DPCM: %.3fs\n"
-        "RLE: %.3fs\n"
-        "Gather Encoded Blocks: %.3fs\n"
-        "Encode Compressed Image: %.3fs\n"
-        "Total time: %.3fs\n",
-        loadImageEndTime - loadImageStartTime,
+        "Convert Bytes to Blocks: %.3fs, peak %.1f MB\n"
+        "DCT + Quantize: %.3fs, peak %.1f MB, DCT error vs reference %.1e\n"
+        "Uniform blocks (DC only): %d of %d\n"
+        "DPCM: %.3fs, peak %.1f MB\n"
+        "RLE: %.3fs, peak %.1f MB, arenas %.1f MB\n"
+        "Gather Encoded Blocks: %.3fs, peak %.1f MB\n"
+        "Encode Compressed Image: %.3fs, peak %.1f MB\n"
+        "Total time: %.3fs\n"
+        "Peak memory: %.1f MB\n"
+        "Bands: %d of %d MCUs per thread\n"
+        "Compressed size: %zu bytes\n",
+        sampleTypeName<T>(), dctImplementationName(options.dctKernel),
+        loadImageStats.seconds, loadImageStats.peakMb(),
+        all ? "YCbCr " : "Y (grayscale)", all ? chromaSubsamplingName(subsampling) : "",
+        quality, options.rdo ? ", RD-optimized quantization" : "",
         mpiSetupEndTime - mpiSetupStartTime,
-        convertBytesToImageEndTime - convertBytesToImageStartTime,
-        convertRgbToYcbcrEndTime - convertRgbToYcbcrStartTime,
-        gatherYcbcrPixelsEndTime - gatherYcbcrPixelsStartTime,
-        convertYcbcrToBlocksEndTime - convertYcbcrToBlocksStartTime,
-        dctEndTime - dctStartTime,
-        quantizeEndTime - quantizeStartTime,
-        dpcmEndTime - dpcmStartTime,
-        encodedBlocksEndTime - encodedBlocksStartTime,
-        gatherEncodedBlocksEndTime - gatherEncodedBlocksStartTime,
-        endTime - encodeCompressedStartTime,
-        endTime - startTime);
+        convertStats.seconds, convertStats.peakMb(),
+        dctStats.seconds, dctStats.peakMb(), dctReferenceError<MACROBLOCK_SIZE>(options.dctKernel, DCT_CHECK_BLOCKS),
+        totalUniformBlocks, numMcus * (grid.lumaBlocksPerMcu() + components - 1),
+        dpcmStats.seconds, dpcmStats.peakMb(),
+        rleStats.seconds, rleStats.peakMb(), arenaBytes / BYTES_PER_MB,
+        gatherStats.seconds, gatherStats.peakMb(),
+        writeStats.seconds, writeStats.peakMb(),
+        endTime - startTime,
+        peakBytes / BYTES_PER_MB,
+        (numWorkerMcus + mcusPerBand - 1) / mcusPerBand, mcusPerBand,
+        compressedBytes);
+        if (options.targetBytes) {
+            fprintf(stdout, "Rate control: %.3fs, peak %.1f MB, quality %d estimated at %zu bytes for a target of %zu\n",
+                rateStats.seconds, rateStats.peakMb(), quality, estimatedBytes, options.targetBytes);
+        }
+        if (!isnan(psnr)) {
+            fprintf(stdout, "PSNR: %.3f dB\n", psnr);
+        }
+        if (options.memBudget && peakBytes > options.memBudget) {
+            fprintf(stderr, "warning: peak memory %.1f MB of master is over the %.1f MB budget\n",
+                peakBytes / BYTES_PER_MB, options.memBudget / BYTES_PER_MB);
+        }
+    }
+}
+
+template <typename T>
+void encode(int mpi, const char* infile, const char* outfile, const char* compressedFile, const EncodeOptions& options) {
+    if (mpi) {
+        encodeMpi<T>(infile, outfile, compressedFile, options);
+    } else {
+        encodeSeq<T>(infile, outfile, compressedFile, options);
     }
 }
 
@@ -669,13 +709,95 @@ int main(int argc, char** argv) {
     std::string filename = argv[1];
     int opt;
     int mpi = 0;
-    while ((opt = getopt(argc, argv, ":p")) != -1) {
+    std::string precision = "double";
+    EncodeOptions options;
+    static struct option long_options[] = {
+        {"precision", required_argument, 0, 'P'},
+        {"mem-budget", required_argument, 0, 'M'},
+        {"band-rows", required_argument, 0, 'B'},
+        {"dct", required_argument, 0, 'D'},
+        {"simd", required_argument, 0, 'S'},
+        {"scale", required_argument, 0, 'C'},
+        {"subsampling", required_argument, 0, 'U'},
+        {"quality", required_argument, 0, 'Q'},
+        {"target-size", required_argument, 0, 'T'},
+        {"rdo", no_argument, 0, 'R'},
+        {0, 0, 0, 0}
+    };
+    while ((opt = getopt_long(argc, argv, ":p", long_options, NULL)) != -1) {
         switch (opt) {
             case 'p':
                 mpi = 1;
                 break;
+            case 'P':
+                precision = optarg;
+                break;
+            case 'M':
+                // budget is given in MB
+                options.memBudget = (size_t) (atof(optarg) * BYTES_PER_MB);
+                break;
+            case 'B':
+                options.bandRows = atoi(optarg);
+                break;
+            case 'D':
+                if (!parseDctKernel(optarg, options.dctKernel)) {
+                    fprintf(stderr, "Unknown DCT kernel %s, expected matrix, aan or llm\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                if (options.dctKernel != DCT_MATRIX && MACROBLOCK_SIZE != FAST_DCT_SIZE) {
+                    fprintf(stderr, "The %s DCT only transforms %dx%d blocks, this build uses %dx%d\n",
+                        optarg, FAST_DCT_SIZE, FAST_DCT_SIZE, MACROBLOCK_SIZE, MACROBLOCK_SIZE);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'S': {
+                // the transforms default to the widest level the CPU has
+                SimdLevel level;
+                if (!parseSimdLevel(optarg, level)) {
+                    fprintf(stderr, "Unknown SIMD level %s, expected none, sse2, avx2 or avx512\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                if (!setDctSimdLevel(level)) {
+                    fprintf(stderr, "This CPU only supports SIMD up to %s\n", simdLevelName(detectSimdLevel()));
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 'C':
+                // 1/8 of a block has to be at least one pixel
+                options.decodeScale = atoi(optarg);
+                if ((options.decodeScale != 1 && options.decodeScale != 2 && options.decodeScale != 4
+                     && options.decodeScale != 8) || options.decodeScale > MACROBLOCK_SIZE) {
+                    fprintf(stderr, "Unsupported decode scale 1/%s, expected 1, 2, 4 or 8 (at most %d)\n", optarg, MACROBLOCK_SIZE);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'U':
+                if (!parseChromaSubsampling(optarg, options.chromaSubsampling)) {
+                    fprintf(stderr, "Unknown chroma subsampling %s, expected 444, 422 or 420\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'Q':
+                options.quality = atoi(optarg);
+                if (options.quality < 1 || options.quality > 100) {
+                    fprintf(stderr, "Quality %s is out of range, expected 1 to 100\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'T':
+                // target is given in KB
+                options.targetBytes = (size_t) (atof(optarg) * 1024);
+                if (options.targetBytes == 0) {
+                    fprintf(stderr, "Target size %s is not a positive number of KB\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'R':
+                options.rdo = true;
+                break;
             default:
-                fprintf(stderr, "Usage: %s [image] [-p]\n", argv[0]);
+                fprintf(stderr, "Usage: %s [image] [-p] [--precision=double|float|int16] [--mem-budget=MB] [--band-rows=N] [--dct=matrix|aan|llm] [--simd=none|sse2|avx2|avx512] [--scale=1|2|4|8] [--subsampling=444|422|420] [--quality=1..100] [--target-size=KB] [--rdo]\n", argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
@@ -684,10 +806,15 @@ int main(int argc, char** argv) {
     std::string image = std::string("images/") + filename + std::string(".png");
     std::string compressed = std::string("compressed/") + filename + std::string(".jpeg");
 
-    if (mpi) {
-        encodeMpi(raw_image.c_str(), image.c_str(), compressed.c_str());
+    if (precision == "double") {
+        encode<double>(mpi, raw_image.c_str(), image.c_str(), compressed.c_str(), options);
+    } else if (precision == "float") {
+        encode<float>(mpi, raw_image.c_str(), image.c_str(), compressed.c_str(), options);
+    } else if (precision == "int16") {
+        encode<int16_t>(mpi, raw_image.c_str(), image.c_str(), compressed.c_str(), options);
     } else {
-        encodeSeq(raw_image.c_str(), image.c_str(), compressed.c_str());
+        fprintf(stderr, "Unknown precision %s, expected double, float or int16\n", precision.c_str());
+        exit(EXIT_FAILURE);
     }
 
     exit(EXIT_SUCCESS);